@@ -6,6 +6,16 @@
 #include "mlp.hpp"
 #include "Loader.hpp"
 #include "activations.hpp"
+#include "gemv.hpp"
+#include "shortlist_head.hpp"
+#include "kv_cache.hpp"
+#include "thread_pool.hpp"
+#include "prefix_cache.hpp"
+#include "distribution_cache.hpp"
+#include "model_shapes.hpp"
+#include "sampling.hpp"
+#include "half.hpp"
+#include "tensor_memory.hpp"
 #include <xtensor/xarray.hpp>
 #include <xtensor/xio.hpp>
 #include <xtensor/xbuilder.hpp>
@@ -15,6 +25,33 @@
 #include <string>
 #include <memory>  // For smart pointers
 #include <random>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <stdexcept>
+#include <limits>
+#include <cstdint>
+#include <future>
+
+// Storage format of the packed decode weights, selectable per layer type
+struct WeightStorage {
+    WeightPrecision attention = WeightPrecision::FP32;  // attn.c_attn, attn.c_proj
+    WeightPrecision mlp = WeightPrecision::FP32;        // mlp.c_fc, mlp.c_proj
+    WeightPrecision lm_head = WeightPrecision::FP32;
+};
+
+// Thrown out of a forward pass whose interrupt check fired between two layers.
+// The caches of the pass are rolled back to their length before it.
+class GenerationInterrupted : public std::runtime_error {
+public:
+    GenerationInterrupted() : std::runtime_error("Generation interrupted") {
+    }
+};
+
+// Polled between transformer layers, returning true abandons the forward pass
+using InterruptCheck = std::function<bool()>;
 
 class GPT2 {
 public:
@@ -27,156 +64,1007 @@ public:
         size_t d_ff;
         size_t vocab_size;
         float dropout_rate;
+        size_t max_positions;  // Rows of the positional embedding table (n_ctx)
+        size_t kv_pool_positions;  // Positions shared by all live sequences in the KV block pool
+        size_t prefill_chunk_size;  // Prompt tokens run per pass, bounds the activation memory of a prefill
+        WeightStorage weight_storage;
+        // Construct returns once the checkpoint shapes are validated, the weights keep loading
+        // in the background and each layer runs as soon as its own weights are in
+        bool streaming_load = false;
+        // Approximate output layer for sampling: lm_head rows grouped into head_clusters k-means
+        // clusters, each step computes exact logits only for the head_probes best clusters.
+        // 0 keeps the exact head. Only callers that pass approximate use it (generate,
+        // generate_next_token, AsyncGenerator), every other path gets exact logits.
+        // The clusters hold a second copy of lm_head in its storage precision: 154 MB more
+        // for the 124M model with FP32 lm_head, 77 MB with BF16 / FP16.
+        size_t head_clusters = 0;
+        size_t head_probes = 16;
+        // Context overflow: once a generation fills max_positions, the oldest context_stride
+        // tokens after the first pinned_tokens are dropped and the rest is prefilled again
+        size_t pinned_tokens = 0;
+        size_t context_stride = 256;
+
+        // Memory of the KV block pool when the caller does not size it
+        static constexpr size_t default_kv_cache_bytes = size_t(1) << 30;
+
+        // Config of one of the model_shapes, e.g. Config::from_shape<model_shapes::Medium355M>().
+        // The KV block pool gets as many positions as fit in kv_cache_bytes, never less than
+        // one full context.
+        template <class Shape>
+        static Config from_shape(const WeightStorage& storage = WeightStorage(),
+                                 size_t kv_cache_bytes = default_kv_cache_bytes) {
+            size_t bytes_per_position = Shape::num_layers * 2 * Shape::d_model * sizeof(float);
+            size_t kv_positions = std::max<size_t>(kv_cache_bytes / bytes_per_position, Shape::max_positions);
+            return Config{
+                Shape::num_layers, Shape::num_heads, Shape::d_model, Shape::head_dim, Shape::head_dim,
+                Shape::d_ff, Shape::vocab_size, 0.0f, Shape::max_positions,
+                kv_positions, 128, storage
+            };
+        }
     };
 
-    GPT2(const std::string& model_path, const std::string& vocab_path) 
-        : tokenizer(vocab_path),
-          config{12, 12, 768, 64, 64, 3072, 50257, 0.0},
+    // The 124M model
+    GPT2(const std::string& model_path, const std::string& vocab_path,
+         const WeightStorage& weight_storage = WeightStorage(),
+         size_t kv_cache_bytes = Config::default_kv_cache_bytes)
+        : GPT2(model_path, vocab_path, Config::from_shape<model_shapes::Small124M>(weight_storage, kv_cache_bytes)) {
+    }
+
+    // Any checkpoint whose dimensions are described by model_config
+    GPT2(const std::string& model_path, const std::string& vocab_path, const Config& model_config)
+        : config(model_config),
+          tokenizer(vocab_path),
           mha(config.num_heads, config.d_model, config.d_k, config.d_v) {  // Initialize MHA with parameters
         initialize(model_path);
     }
 
     // Make destructor virtual and public
-    virtual ~GPT2() = default;
+    virtual ~GPT2() {
+        finish_loading_tasks();
+        if (kv_pool) {
+            kv_pool->set_reclaim(nullptr);  // Caches may outlive the model and its distribution cache
+        }
+    }
+
+    // With Config::streaming_load, blocks until every weight is loaded and rethrows a load error
+    void wait_until_loaded() const {
+        wait_for(embedding_ready);
+        for (const auto& ready : layer_ready) {
+            wait_for(ready);
+        }
+        wait_for(head_ready);
+    }
+
     std::string generate_next_token(const std::string& input_text, int k) {
-        // Tokenize input
-        xt::xarray<int> tokens = tokenizer.encode(input_text);
-        
-        // Create look ahead mask
-        xt::xarray<float> look_ahead_mask = create_look_ahead_mask(tokens.shape()[0]);
-        
-        // Forward pass
-        auto logits = forward(tokens, look_ahead_mask);
-        
-        // Get last token probabilities
-        xt::xarray<float> last_token_probs = xt::view(logits, xt::all(), -1, xt::all());
-
-        //Flatten the probabilities
-        xt::xarray<float> flat_probs = xt::flatten(last_token_probs);
-        xt::xarray<size_t> sorted_indices = xt::argsort(flat_probs);
-        sorted_indices = xt::flip(sorted_indices);
-
-        // Get top k indices and their probabilities
-        xt::xarray<size_t> top_k_indices = xt::view(sorted_indices, xt::range(0, k));
-        xt::xarray<float> top_k_probs = xt::zeros<float>({k});
-
-        // Extract probabilities for top k indices
-        for(size_t i = 0; i < k; ++i) {
-            top_k_probs[i] = flat_probs[top_k_indices[i]];
-        }
-        
-        // Normalize the top k probabilities
-        float sum = xt::sum(top_k_probs)();
-        top_k_probs = top_k_probs / sum;
-        
-        // Random sampling
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_real_distribution<float> dis(0.0, 1.0);
-        
-        float rand_val = dis(gen);
-        float cumsum = 0.0;
-        
-        // Sample based on normalized probabilities
-        for(size_t i = 0; i < k; ++i) {
-            cumsum += top_k_probs[i];
-            if(rand_val <= cumsum) {
-                // Create a single-element xarray for the token ID
-                xt::xarray<int> token_id = {static_cast<int>(top_k_indices[i])};
-                return tokenizer.decode(token_id);
-            }
-        }
-
-        // Fallback case: decode the most probable token
-        xt::xarray<int> token_id = {static_cast<int>(top_k_indices[0])};
+        // Tokenize input, a prompt longer than the context keeps its newest tokens
+        std::vector<int> tokens = fit_context(tokenize(input_text));
+        if (tokens.empty()) {
+            throw std::invalid_argument("Prompt must contain at least one token");
+        }
+
+        // Chunked prefill, only the last position goes through lm_head
+        KVCache cache = create_cache();
+        std::vector<float> logits(config.vocab_size);
+        prefill(tokens.data(), tokens.size(), cache, logits.data(), nullptr, true, k);
+
+        // Create a single-element xarray for the sampled token ID
+        xt::xarray<int> token_id = {sample_top_k(logits.data(), k)};
         return tokenizer.decode(token_id);
     }
 
+    // A fresh KV cache drawing its blocks from the model's shared block pool
+    KVCache create_cache() const {
+        return KVCache(kv_pool, config.max_positions);
+    }
+
+    const Config& model_config() const {
+        return config;
+    }
+
+    const KVBlockPool& kv_block_pool() const {
+        return *kv_pool;
+    }
+
+    // Bytes held by the packed linear layers
+    size_t packed_weight_bytes() const {
+        wait_until_loaded();
+        size_t bytes = packed_lm_head.weight_bytes();
+        if (shortlist_head) {
+            bytes += shortlist_head->weight_bytes();
+        }
+        for (const auto& block : decode_blocks) {
+            bytes += block.c_attn.weight_bytes() + block.attn_proj.weight_bytes() +
+                     block.c_fc.weight_bytes() + block.mlp_proj.weight_bytes();
+        }
+        return bytes;
+    }
+
+    // Runs the tokens through the decode path at the positions following the ones
+    // already in the cache and returns the logits of the last token [vocab_size]
+    xt::xarray<float> forward_cached(const xt::xarray<int>& tokens, KVCache& cache) {
+        xt::xarray<float> logits = xt::zeros<float>({config.vocab_size});
+        run_cached(tokens.data(), tokens.size(), cache, logits.data());
+        return logits;
+    }
+
+    // Keeps the K/V of prompt prefixes across generate calls (shared system prompts,
+    // few-shot templates) so that a new prompt only prefills its unseen suffix
+    void enable_prefix_cache(size_t memory_budget_bytes) {
+        prefix_cache = std::make_unique<PrefixCache>(config.num_layers, config.d_model, memory_budget_bytes);
+    }
+
+    // Long prompts are prefilled in slices of this many tokens, each slice attends to the
+    // K/V cached by the earlier ones. Peak activation memory grows with the chunk size,
+    // not with the prompt length.
+    void set_prefill_chunk_size(size_t tokens) {
+        if (tokens == 0) {
+            throw std::invalid_argument("Prefill chunk size must be positive");
+        }
+        config.prefill_chunk_size = tokens;
+    }
+
+    // Clusters scored per step by the shortlist head (Config::head_clusters), more probes
+    // trade speed for recall. Not to be changed while a forward pass is running.
+    void set_head_probes(size_t probes) {
+        wait_for(head_ready);
+        config.head_probes = probes;
+        if (shortlist_head) {
+            shortlist_head->set_probes(probes);
+        }
+    }
+
+    // Context overflow policy of generate: the first pinned_tokens tokens (a system prompt,
+    // instructions) always stay, when the window is full the oldest stride tokens after them
+    // are dropped at once. The positional embeddings are absolute, so the retained tokens
+    // are prefilled again at their new positions, in one batched pass; a large stride makes
+    // that pass rare, a small one keeps more context.
+    void set_context_window(size_t pinned_tokens, size_t stride) {
+        if (stride == 0 || pinned_tokens + stride >= config.max_positions) {
+            throw std::invalid_argument("The context window needs pinned_tokens + stride < max_positions and a positive stride");
+        }
+        config.pinned_tokens = pinned_tokens;
+        config.context_stride = stride;
+    }
+
+    // The part of tokens that fits the context: all of them when they fit, otherwise
+    // the pinned prefix followed by the newest tokens, leaving a stride of free positions
+    std::vector<int> fit_context(const std::vector<int>& tokens) const {
+        if (tokens.size() <= config.max_positions) {
+            return tokens;
+        }
+        size_t pinned = std::min(config.pinned_tokens, tokens.size());
+        std::vector<int> window(tokens.begin(), tokens.begin() + pinned);
+        window.insert(window.end(), tokens.end() - window_tail(), tokens.end());
+        return window;
+    }
+
+    // Appends token to a sequence whose cache holds the K/V of window and writes the
+    // next-token logits. With the cache full the window shifts first: the cache keeps the
+    // pinned prefix, whose positions do not move, and the newest tokens run after it.
+    // Returns true when the window shifted. Sampling callers pass approximate to allow
+    // the shortlist head (Config::head_clusters), the logits outside it are then -inf.
+    // When the pass throws (GenerationInterrupted) window and cache are left as they were;
+    // during a shift the old blocks stay held until the pass is through.
+    bool append_token(std::vector<int>& window, int token, KVCache& cache, float* logits,
+                      const InterruptCheck& interrupted = nullptr, bool approximate = false) {
+        if (cache.size() < config.max_positions) {
+            run_cached(&token, 1, cache, logits, interrupted, approximate);  // Rolls the cache back on a throw
+            window.push_back(token);
+            return false;
+        }
+
+        size_t pinned = std::min(config.pinned_tokens, cache.size());
+        std::vector<int> shifted(window.begin(), window.begin() + pinned);
+        shifted.insert(shifted.end(), window.end() - (window_tail() - 1), window.end());
+        shifted.push_back(token);
+
+        KVCache previous = cache.fork();
+        cache.resize(pinned);
+        try {
+            run_cached(shifted.data() + pinned, shifted.size() - pinned, cache, logits, interrupted, approximate);
+        } catch (...) {
+            cache = std::move(previous);
+            throw;
+        }
+        window = std::move(shifted);
+        return true;
+    }
+
+    PrefixCache::Stats prefix_cache_stats() const {
+        return prefix_cache ? prefix_cache->stats() : PrefixCache::Stats{0, 0, 0, 0};
+    }
+
+    // Remembers the top_n next-token logits and the K/V of the last entries prompts. A prompt
+    // extending a cached one only runs its new tokens. An exact repeat skips the forward pass
+    // for callers sampling top-k with k <= top_n (prefill with approximate and top_k), whose
+    // logits are then the stored top_n with -inf elsewhere, which leaves their top-k
+    // unchanged; every other caller reruns the last token on the cached K/V and gets the
+    // full distribution. Entries hold their KV blocks in the model's block pool, at most a
+    // quarter of the pool, and are evicted oldest first whenever a sequence finds the pool
+    // exhausted.
+    // Not to be called while sequences are running.
+    void enable_distribution_cache(size_t entries, size_t top_n = 64) {
+        kv_pool->set_reclaim(nullptr);
+        distribution_cache = std::make_unique<DistributionCache>(
+            entries, top_n, std::max<size_t>(kv_pool->total_blocks() / 4, 1));
+        DistributionCache* cache = distribution_cache.get();
+        kv_pool->set_reclaim([cache] { return cache->evict_oldest(); });
+    }
+
+    DistributionCache::Stats distribution_cache_stats() const {
+        return distribution_cache ? distribution_cache->stats() : DistributionCache::Stats{0, 0, 0, 0, 0, 0};
+    }
+
+    std::vector<int> tokenize(const std::string& text) {
+        xt::xarray<int> tokens = tokenizer.encode(text);
+        return std::vector<int>(tokens.begin(), tokens.end());
+    }
+
+    std::string detokenize(const std::vector<int>& tokens) {
+        xt::xarray<int> token_ids = xt::adapt(tokens);
+        return tokenizer.decode(token_ids);
+    }
+
+    // Runs a whole prompt into an empty cache and writes the logits of its last token
+    // into logits [vocab_size]. When interrupted returns true between two layers the
+    // prefill stops with GenerationInterrupted. approximate allows the shortlist head, for
+    // callers that only sample from the logits; those that sample top-k also pass their k,
+    // with k <= top_n an exact repeat in the distribution cache gets the stored top_n logits.
+    void prefill(const std::vector<int>& tokens, KVCache& cache, float* logits,
+                 const InterruptCheck& interrupted = nullptr, bool approximate = false, int top_k = 0) {
+        if (tokens.empty()) {
+            throw std::invalid_argument("Prompt must contain at least one token");
+        }
+        prefill(tokens.data(), tokens.size(), cache, logits, interrupted, approximate, top_k);
+    }
+
+    // One decode step for several sequences at once: tokens[i] is appended to caches[i]
+    // and logits receives their next token logits [tokens.size(), vocab_size].
+    // Every weight matrix is streamed once for the whole batch. The caches must be distinct.
+    // approximate allows the shortlist head, as for prefill.
+    void decode_batch(const std::vector<int>& tokens, const std::vector<KVCache*>& caches, float* logits,
+                      const InterruptCheck& interrupted = nullptr, bool approximate = false) {
+        if (caches.size() != tokens.size()) {
+            throw std::invalid_argument("decode_batch needs one cache per token");
+        }
+        if (tokens.empty()) {
+            return;
+        }
+
+        size_t d = config.d_model;
+        Activations hidden(tokens.size() * d);
+        std::vector<BatchItem> batch;
+        batch.reserve(tokens.size());
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            batch.push_back(BatchItem{caches[i], &tokens[i], 1, hidden.data() + i * d});
+        }
+
+        run_blocks(batch, interrupted);
+        run_head(hidden.data(), tokens.size(), logits, approximate);
+    }
+
+    // Runs n tokens after the cached positions through the first num_blocks transformer blocks
+    // and writes the logits of every one of them into logits [n, vocab_size].
+    // With fewer blocks than the model has this is an early-exit pass through the shared
+    // ln_f / lm_head, only the layers that ran get their K/V written for the new positions.
+    void forward_logits(const int* tokens, size_t n, KVCache& cache, float* logits,
+                        size_t num_blocks = std::numeric_limits<size_t>::max()) {
+        if (n == 0) {
+            throw std::invalid_argument("forward_logits needs at least one token");
+        }
+
+        size_t cached = cache.size();
+        Activations hidden(n * config.d_model);
+        try {
+            for (size_t start = 0; start < n; start += config.prefill_chunk_size) {
+                size_t chunk = std::min(config.prefill_chunk_size, n - start);
+                run_blocks({BatchItem{&cache, tokens + start, chunk, nullptr, hidden.data() + start * config.d_model}},
+                           nullptr, num_blocks);
+            }
+            run_head(hidden.data(), n, logits);
+        } catch (...) {
+            cache.resize(cached);  // Same as run_cached, the earlier chunks go too
+            throw;
+        }
+    }
+
+    // Stages of a forward pass for pipelined execution (pipeline_executor.hpp), each stage
+    // runs a contiguous range of blocks on its own thread pool. Rows of the items are stacked
+    // in x [rows, d_model] in item order. The positions of every item have to be allocated in
+    // its cache up front: stages run concurrently and never resize a cache.
+    struct StageItem {
+        KVCache* cache;
+        const int* tokens;
+        size_t n;
+        size_t position;  // Position of tokens[0], the ones before it are cached or run earlier
+    };
+
+    void embed_stage(const std::vector<StageItem>& items, float* x) {
+        wait_for(embedding_ready);
+        size_t row = 0;
+        for (const auto& item : items) {
+            input_embedding->forward(item.tokens, item.n, item.position, x + row * config.d_model);
+            row += item.n;
+        }
+    }
+
+    // Blocks [first, last)
+    void block_stage(const std::vector<StageItem>& items, float* x, size_t first, size_t last, ThreadPool& on) {
+        std::vector<size_t> offsets(items.size());
+        size_t rows = 0;
+        for (size_t b = 0; b < items.size(); ++b) {
+            offsets[b] = rows;
+            rows += items[b].n;
+        }
+        BlockScratch scratch(rows, config.d_model, config.d_ff);
+        for (size_t i = first; i < std::min(last, config.num_layers); ++i) {
+            run_block(i, items, offsets, rows, x, scratch, on);
+        }
+    }
+
+    // ln_f and the exact lm_head for rows hidden states, logits [rows, vocab_size]
+    void head_stage(const float* hidden, size_t rows, float* logits, ThreadPool& on) {
+        run_head(hidden, rows, logits, false, &on);
+    }
+
+    // A run of tokens scored in one pass, log_probs[i] receives the natural log-probability
+    // of tokens[score_from + i] given the tokens before it in the window.
+    // score_from >= 1, the first token has no context to be predicted from.
+    struct ScoringWindow {
+        const int* tokens;
+        size_t n;           // At most max_positions
+        size_t score_from;
+        float* log_probs;   // [n - score_from]
+    };
+
+    // Scores several windows together: their rows are stacked in every layer so the weights
+    // are streamed once per prefill chunk for the whole batch. lm_head only runs on the
+    // scored rows, a few at a time, and the log-softmax is taken at the target token only,
+    // the [tokens, vocab_size] probability tensor is never materialized.
+    void score_windows(const std::vector<ScoringWindow>& windows) {
+        size_t d = config.d_model;
+        size_t longest = 0;
+        for (const ScoringWindow& window : windows) {
+            if (window.n > config.max_positions) {
+                throw std::invalid_argument("Scoring window is longer than the model context");
+            }
+            if (window.score_from == 0 || window.score_from > window.n) {
+                throw std::invalid_argument("Scoring window needs 1 <= score_from <= n");
+            }
+            longest = std::max(longest, window.n);
+        }
+
+        std::vector<Activations> hidden(windows.size());
+        {
+            std::vector<KVCache> caches;
+            caches.reserve(windows.size());
+            for (size_t w = 0; w < windows.size(); ++w) {
+                caches.push_back(create_cache());
+                hidden[w].resize(windows[w].n * d);
+            }
+
+            for (size_t start = 0; start < longest; start += config.prefill_chunk_size) {
+                std::vector<BatchItem> batch;
+                for (size_t w = 0; w < windows.size(); ++w) {
+                    if (start < windows[w].n) {
+                        size_t chunk = std::min(config.prefill_chunk_size, windows[w].n - start);
+                        batch.push_back(BatchItem{
+                            &caches[w], windows[w].tokens + start, chunk, nullptr, hidden[w].data() + start * d});
+                    }
+                }
+                run_blocks(batch);
+            }
+        }
+
+        // The hidden state at position t - 1 predicts token t
+        for (size_t w = 0; w < windows.size(); ++w) {
+            const ScoringWindow& window = windows[w];
+            target_log_probs(
+                hidden[w].data() + (window.score_from - 1) * d, window.tokens + window.score_from,
+                window.n - window.score_from, window.log_probs);
+        }
+    }
+
+    enum class Pooling {
+        PerToken,   // One row per token
+        Mean,       // Average over the tokens of a document
+        LastToken,
+    };
+
+    // Hidden state k is the embedding output for k = 0 and the output of block k otherwise.
+    // The features are the average of hidden states first_layer..last_layer, blocks after
+    // last_layer are not run at all.
+    struct FeatureOptions {
+        size_t first_layer = std::numeric_limits<size_t>::max();  // Default: the last hidden state
+        size_t last_layer = std::numeric_limits<size_t>::max();   // Clamped to num_layers
+        Pooling pooling = Pooling::Mean;
+        bool final_layer_norm = true;  // Hidden state num_layers is taken after ln_f, as fed to lm_head
+        size_t documents_per_batch = 16;
+    };
+
+    // Rows written by extract_features: one per token for PerToken, one per document otherwise.
+    // Documents longer than max_positions are cut to their first max_positions tokens.
+    size_t feature_rows(const std::vector<std::vector<int>>& documents, const FeatureOptions& options) const {
+        if (options.pooling != Pooling::PerToken) {
+            return documents.size();
+        }
+        size_t rows = 0;
+        for (const auto& document : documents) {
+            rows += std::min(document.size(), config.max_positions);
+        }
+        return rows;
+    }
+
+    // Hidden-state features of many documents, lm_head is never run.
+    // out holds feature_rows(documents, options) rows of d_model values, documents in order.
+    // Documents are batched together, their rows stacked in every layer.
+    void extract_features(const std::vector<std::vector<int>>& documents, const FeatureOptions& options, float* out) {
+        size_t d = config.d_model;
+        run_features(documents, options, [out, d](size_t row, const float* features) {
+            std::copy(features, features + d, out + row * d);
+        });
+    }
+
+    // Same with the features rounded to IEEE fp16, half the output size
+    void extract_features(const std::vector<std::vector<int>>& documents, const FeatureOptions& options, uint16_t* out) {
+        size_t d = config.d_model;
+        run_features(documents, options, [out, d](size_t row, const float* features) {
+            for (size_t j = 0; j < d; ++j) {
+                out[row * d + j] = half::float_to_fp16(features[j]);
+            }
+        });
+    }
+
+    // Generates up to max_new_tokens tokens after the prompt with top-k sampling.
+    // The prompt goes through the model once, after that every step only runs the newly
+    // sampled token against the KV cache. on_token receives each decoded token and
+    // stops the generation by returning false.
+    std::string generate(
+        const std::string& prompt,
+        size_t max_new_tokens,
+        int k,
+        const std::function<bool(const std::string&)>& on_token = nullptr
+    ) {
+        std::vector<int> window = fit_context(tokenize(prompt));
+        if (window.empty()) {
+            throw std::invalid_argument("Prompt must contain at least one token");
+        }
+
+        KVCache cache = create_cache();
+        std::vector<float> logits(config.vocab_size);
+        prefill(window.data(), window.size(), cache, logits.data(), nullptr, true, k);
+
+        std::string text;
+        for (size_t step = 0; step < max_new_tokens; ++step) {
+            int token = sample_top_k(logits.data(), k);
+
+            xt::xarray<int> token_id = {token};
+            std::string piece = tokenizer.decode(token_id);
+            text += piece;
+
+            if (on_token && !on_token(piece)) {
+                break;
+            }
+            if (step + 1 < max_new_tokens) {
+                append_token(window, token, cache, logits.data(), nullptr, true);
+            }
+        }
+
+        return text;
+    }
+
 private:
     Config config;
     GPT2Tokenizer tokenizer;
     std::unique_ptr<InputEmbedding> input_embedding;  // Use smart pointer
     LayerNormalization layernorm;
     MultiHeadAttention mha;
-    MLP mlp;
-    
-    // Store model parameters
-    std::unordered_map<std::string, xt::xarray<float>> parameters;
     
+    // Layer norm parameters, the packed linear layers hold everything else
+    using WeightVector = tensor_memory::Vector<float, tensor_memory::Category::Weights>;
+
+    // Weights of one transformer block in the layout used by the decode path
+    struct DecodeBlock {
+        WeightVector ln_1_weight;
+        WeightVector ln_1_bias;
+        WeightVector ln_2_weight;
+        WeightVector ln_2_bias;
+        PackedLinear c_attn;
+        PackedLinear attn_proj;
+        PackedLinear c_fc;  // GELU fused
+        PackedLinear mlp_proj;
+    };
+
+    // Buffers of the forward passes, counted as activation memory
+    using Activations = tensor_memory::Vector<float, tensor_memory::Category::Activations>;
+
+    ThreadPool pool;
+    std::vector<DecodeBlock> decode_blocks;
+    WeightVector ln_f_weight;
+    WeightVector ln_f_bias;
+    PackedLinear packed_lm_head;
+    std::unique_ptr<ShortlistHead> shortlist_head;  // Only with Config::head_clusters
+    std::shared_ptr<KVBlockPool> kv_pool;
+    std::unique_ptr<PrefixCache> prefix_cache;
+    std::unique_ptr<DistributionCache> distribution_cache;
+    std::mt19937 rng{std::random_device{}()};
+
+    // Become ready once the embedding, block i and ln_f / lm_head respectively are in place
+    std::shared_future<void> embedding_ready;
+    std::vector<std::shared_future<void>> layer_ready;
+    std::shared_future<void> head_ready;
+
     void initialize(const std::string& model_path) {
-        // Load weights
-        GPT2WeightLoader loader;
-        parameters = loader.loadWeights(model_path);
-        
-        // Initialize embedding layers using smart pointer
-        input_embedding = std::make_unique<InputEmbedding>(
-            parameters["transformer.wte.weight"],
-            parameters["transformer.wpe.weight"]
-        );
+        GPT2WeightLoader loader(config.num_layers);
+        loader.validateShapes(model_path, {config.d_model, config.d_ff, config.vocab_size, config.max_positions});
+        loader.prefetch(model_path);
+
+        size_t block_size = KVBlockPool::default_block_size;
+        kv_pool = std::make_shared<KVBlockPool>(
+            config.num_layers, config.d_model,
+            (config.kv_pool_positions + block_size - 1) / block_size, block_size);
+
+        // One task per group of weights, queued in the order the forward pass needs them.
+        // Each task reads its files and packs them, the fp32 tensors die with the task.
+        embedding_ready = load_async([this, loader, model_path] {
+            auto weights = loader.loadWeights(model_path, loader.getEmbeddingWeightPaths());
+            input_embedding = std::make_unique<InputEmbedding>(
+                weights.at("transformer.wte.weight"), weights.at("transformer.wpe.weight"));
+        });
+
+        decode_blocks.resize(config.num_layers);
+        for (size_t i = 0; i < config.num_layers; ++i) {
+            layer_ready.push_back(load_async([this, loader, model_path, i] {
+                auto weights = loader.loadWeights(model_path, loader.getLayerWeightPaths(i));
+                decode_blocks[i] = pack_block(weights, "transformer.h." + std::to_string(i) + ".");
+            }));
+        }
+
+        head_ready = load_async([this, loader, model_path] {
+            auto weights = loader.loadWeights(model_path, loader.getHeadWeightPaths());
+            const auto& ln_f_w = weights.at("transformer.ln_f.weight");
+            const auto& ln_f_b = weights.at("transformer.ln_f.bias");
+            ln_f_weight.assign(ln_f_w.begin(), ln_f_w.end());
+            ln_f_bias.assign(ln_f_b.begin(), ln_f_b.end());
+
+            // lm_head.weight is stored as [vocab_size, d_model]
+            packed_lm_head = PackedLinear(
+                weights.at("lm_head.weight").data(), config.d_model, config.vocab_size,
+                nullptr, FusedActivation::None, true, config.weight_storage.lm_head);
+            if (config.head_clusters > 0) {
+                shortlist_head = std::make_unique<ShortlistHead>(
+                    weights.at("lm_head.weight").data(), config.vocab_size, config.d_model,
+                    config.head_clusters, config.head_probes, &pool, 6, 0, config.weight_storage.lm_head);
+            }
+        });
+
+        if (!config.streaming_load) {
+            // Every task has to be done before a load error leaves the constructor
+            finish_loading_tasks();
+            wait_until_loaded();
+        }
     }
-    
-    xt::xarray<float> create_look_ahead_mask(size_t seq_length) {
-        xt::xarray<float> mask = xt::triu(xt::ones<float>({seq_length, seq_length}), 1);
-        return xt::expand_dims(mask, 0);
+
+    // Waits for the loading tasks without looking at their outcome, they write into the members
+    void finish_loading_tasks() const {
+        for (const auto* ready : {&embedding_ready, &head_ready}) {
+            if (ready->valid()) ready->wait();
+        }
+        for (const auto& ready : layer_ready) {
+            ready.wait();
+        }
     }
-    
-    xt::xarray<float> forward(const xt::xarray<int>& tokens, const xt::xarray<float>& look_ahead_mask) {
-        std::string path_prefix = "transformer.h.";
-        
-        // Input embedding
-        auto x = input_embedding->forward(tokens);
-        
-        // Transform through layers
-        for(size_t i = 0; i < config.num_layers; ++i) {
-            std::string layer_prefix = path_prefix + std::to_string(i) + ".";
-            
-            // Layer normalization 1
-            auto ln1_out = layernorm.forward(
-                x,
-                parameters[layer_prefix + "ln_1.weight"],
-                parameters[layer_prefix + "ln_1.bias"]
-            );
-            
-            // Self attention
-            auto attn_out = mha.forward(
-                ln1_out,
-                parameters[layer_prefix + "attn.c_attn.weight"],
-                parameters[layer_prefix + "attn.c_proj.weight"],
-                parameters[layer_prefix + "attn.c_attn.bias"],
-                parameters[layer_prefix + "attn.c_proj.bias"],
-                &look_ahead_mask
-            );
-            
-            x = x + attn_out;
-            
-            // Layer normalization 2
-            auto ln2_out = layernorm.forward(
-                x,
-                parameters[layer_prefix + "ln_2.weight"],
-                parameters[layer_prefix + "ln_2.bias"]
-            );
-            
-            // MLP
-            auto mlp_out = mlp.forward(
-                ln2_out,
-                parameters[layer_prefix + "mlp.c_fc.weight"],
-                parameters[layer_prefix + "mlp.c_fc.bias"],
-                parameters[layer_prefix + "mlp.c_proj.weight"],
-                parameters[layer_prefix + "mlp.c_proj.bias"]
-            );
-            
-            x = x + mlp_out;
-        }
-        
-        // Final layer norm
-        x = layernorm.forward(
-            x,
-            parameters["transformer.ln_f.weight"],
-            parameters["transformer.ln_f.bias"]
-        );
-        
-        // Output projection and softmax
-        auto logits = xt::linalg::dot(x, xt::transpose(parameters["lm_head.weight"]));
-        return activation::Softmax::forward(logits, 2);
-    }
-};
\ No newline at end of file
+
+    // Runs a loading task on the pool. With a single thread there is no worker to run it,
+    // the task then runs right away.
+    std::shared_future<void> load_async(std::function<void()> task) {
+        if (pool.size() > 1) {
+            return pool.submit(std::move(task)).share();
+        }
+        std::packaged_task<void()> inline_task(std::move(task));
+        inline_task();
+        return inline_task.get_future().share();
+    }
+
+    // Blocks until a group of weights is in place, rethrows the error of a failed load
+    static void wait_for(const std::shared_future<void>& ready) {
+        ready.get();
+    }
+
+    // Re-packs the linear layers of one block for the decode kernels, converting them to
+    // the configured storage precision
+    DecodeBlock pack_block(const GPT2WeightLoader::WeightMap& weights, const std::string& layer_prefix) const {
+        size_t d = config.d_model;
+        const WeightStorage& storage = config.weight_storage;
+        auto tensor = [&](const char* name) -> const xt::xarray<float>& {
+            return weights.at(layer_prefix + name);
+        };
+
+        DecodeBlock block;
+        block.ln_1_weight.assign(tensor("ln_1.weight").begin(), tensor("ln_1.weight").end());
+        block.ln_1_bias.assign(tensor("ln_1.bias").begin(), tensor("ln_1.bias").end());
+        block.ln_2_weight.assign(tensor("ln_2.weight").begin(), tensor("ln_2.weight").end());
+        block.ln_2_bias.assign(tensor("ln_2.bias").begin(), tensor("ln_2.bias").end());
+
+        block.c_attn = PackedLinear(
+            tensor("attn.c_attn.weight").data(), d, 3 * d, tensor("attn.c_attn.bias").data(),
+            FusedActivation::None, false, storage.attention);
+        block.attn_proj = PackedLinear(
+            tensor("attn.c_proj.weight").data(), d, d, tensor("attn.c_proj.bias").data(),
+            FusedActivation::None, false, storage.attention);
+        block.c_fc = PackedLinear(
+            tensor("mlp.c_fc.weight").data(), d, config.d_ff, tensor("mlp.c_fc.bias").data(),
+            FusedActivation::GELU, false, storage.mlp);
+        block.mlp_proj = PackedLinear(
+            tensor("mlp.c_proj.weight").data(), config.d_ff, d, tensor("mlp.c_proj.bias").data(),
+            FusedActivation::None, false, storage.mlp);
+        return block;
+    }
+
+    // One sequence of a batched pass through the transformer blocks
+    struct BatchItem {
+        KVCache* cache;
+        const int* tokens;
+        size_t n;                     // Tokens appended after the cached positions
+        float* last_hidden;           // Receives the hidden state of the last token [d_model], may be null
+        float* hidden = nullptr;      // Receives the hidden states of all n tokens [n, d_model], may be null
+    };
+
+    // Decode path: runs n tokens after the cached positions, appends their keys/values
+    // to the cache and writes the logits of the last token into logits [vocab_size].
+    // Prompts longer than prefill_chunk_size are processed chunk by chunk. On a throw the
+    // cache is cut back to its length on entry, the chunks already run included.
+    void run_cached(const int* tokens, size_t n, KVCache& cache, float* logits,
+                    const InterruptCheck& interrupted = nullptr, bool approximate = false) {
+        if (n == 0) {
+            throw std::invalid_argument("run_cached needs at least one token");
+        }
+
+        size_t cached = cache.size();
+        std::vector<float> hidden(config.d_model);
+        try {
+            for (size_t start = 0; start < n; start += config.prefill_chunk_size) {
+                size_t chunk = std::min(config.prefill_chunk_size, n - start);
+                run_blocks({BatchItem{&cache, tokens + start, chunk, hidden.data()}}, interrupted);
+            }
+            run_head(hidden.data(), 1, logits, approximate);
+        } catch (...) {
+            cache.resize(cached);
+            throw;
+        }
+    }
+
+    // Runs the tokens of every item through the transformer blocks in one pass.
+    // The rows of all items are stacked so each weight matrix is streamed once for the
+    // whole batch, attention runs per item against its own cache.
+    // All buffers are [total tokens, ...], so the batch bounds the memory.
+    // interrupted is polled before every layer, the pass is abandoned when it returns true.
+    // Only the first num_blocks blocks run. on_hidden sees the stacked hidden states [rows, d_model]
+    // after the embedding (index 0) and after every block i (index i + 1).
+    void run_blocks(
+        const std::vector<BatchItem>& batch,
+        const InterruptCheck& interrupted = nullptr,
+        size_t num_blocks = std::numeric_limits<size_t>::max(),
+        const std::function<void(size_t, const float*)>& on_hidden = nullptr
+    ) {
+        size_t d = config.d_model;
+        std::vector<size_t> offsets(batch.size());
+        std::vector<StageItem> items(batch.size());
+        size_t rows = 0;
+        for (size_t b = 0; b < batch.size(); ++b) {
+            offsets[b] = rows;
+            rows += batch[b].n;
+            items[b] = StageItem{batch[b].cache, batch[b].tokens, batch[b].n, batch[b].cache->size()};
+        }
+
+        Activations x(rows * d);
+        BlockScratch scratch(rows, d, config.d_ff);
+
+        size_t grown = 0;
+        try {
+            for (; grown < batch.size(); ++grown) {
+                batch[grown].cache->resize(items[grown].position + batch[grown].n);
+            }
+
+            embed_stage(items, x.data());
+            if (on_hidden) {
+                on_hidden(0, x.data());
+            }
+
+            for (size_t i = 0; i < std::min(num_blocks, config.num_layers); ++i) {
+                if (interrupted && interrupted()) {
+                    throw GenerationInterrupted();
+                }
+                run_block(i, items, offsets, rows, x.data(), scratch, pool);
+                if (on_hidden) {
+                    on_hidden(i + 1, x.data());
+                }
+            }
+        } catch (...) {
+            for (size_t b = 0; b < grown; ++b) {
+                batch[b].cache->resize(items[b].position);
+            }
+            throw;
+        }
+
+        for (size_t b = 0; b < batch.size(); ++b) {
+            const float* first = x.data() + offsets[b] * d;
+            if (batch[b].last_hidden) {
+                std::copy(first + (batch[b].n - 1) * d, first + batch[b].n * d, batch[b].last_hidden);
+            }
+            if (batch[b].hidden) {
+                std::copy(first, first + batch[b].n * d, batch[b].hidden);
+            }
+        }
+    }
+
+    // Buffers of one pass through the blocks for rows stacked tokens
+    struct BlockScratch {
+        Activations h, qkv, attn, proj, ff;
+
+        BlockScratch(size_t rows, size_t d_model, size_t d_ff)
+            : h(rows * d_model), qkv(rows * 3 * d_model), attn(rows * d_model), proj(rows * d_model),
+              ff(rows * d_ff) {}
+    };
+
+    // Transformer block i on the stacked rows x [rows, d_model], item b starts at row offsets[b].
+    // Runs on the given pool, so pipeline stages keep their layers on their own cores.
+    void run_block(size_t i, const std::vector<StageItem>& items, const std::vector<size_t>& offsets,
+                   size_t rows, float* x, BlockScratch& s, ThreadPool& on) {
+        size_t d = config.d_model;
+        wait_for(layer_ready[i]);
+        const DecodeBlock& block = decode_blocks[i];
+
+        // Attention sub-block
+        layernorm.forward(x, block.ln_1_weight.data(), block.ln_1_bias.data(), rows, d, s.h.data());
+        block.c_attn.forward(s.h.data(), rows, s.qkv.data(), &on);
+        for (size_t b = 0; b < items.size(); ++b) {
+            mha.forward_cached(
+                s.qkv.data() + offsets[b] * 3 * d, items[b].n, *items[b].cache,
+                i, items[b].position, s.attn.data() + offsets[b] * d, &on);
+        }
+        block.attn_proj.forward(s.attn.data(), rows, s.proj.data(), &on);
+        add_inplace(x, s.proj);
+
+        // MLP sub-block
+        layernorm.forward(x, block.ln_2_weight.data(), block.ln_2_bias.data(), rows, d, s.h.data());
+        block.c_fc.forward(s.h.data(), rows, s.ff.data(), &on);
+        block.mlp_proj.forward(s.ff.data(), rows, s.proj.data(), &on);
+        add_inplace(x, s.proj);
+    }
+
+    // Final layer norm and output projection of rows hidden states [rows, d_model].
+    // approximate takes the shortlist head when the model has one, the logits outside the
+    // shortlist are then -inf. Only callers that sample from the logits may pass it.
+    void run_head(const float* hidden, size_t rows, float* logits, bool approximate = false,
+                  ThreadPool* on = nullptr) {
+        Activations h(rows * config.d_model);
+        wait_for(head_ready);
+        layernorm.forward(hidden, ln_f_weight.data(), ln_f_bias.data(), rows, config.d_model, h.data());
+        if (approximate && shortlist_head) {
+            shortlist_head->forward(h.data(), rows, logits, on ? on : &pool);
+        } else {
+            packed_lm_head.forward(h.data(), rows, logits, on ? on : &pool);
+        }
+    }
+
+    // Runs batches of documents up to options.last_layer and hands every feature row to write
+    void run_features(
+        const std::vector<std::vector<int>>& documents,
+        const FeatureOptions& options,
+        const std::function<void(size_t, const float*)>& write
+    ) {
+        size_t d = config.d_model;
+        size_t last = std::min(options.last_layer, config.num_layers);
+        size_t first = std::min(options.first_layer, last);
+        float layer_scale = 1.0f / static_cast<float>(last - first + 1);
+        bool final_norm = options.final_layer_norm && last == config.num_layers;
+        size_t block_size = kv_pool->block_size();
+
+        size_t out_row = 0;
+        size_t doc = 0;
+        while (doc < documents.size()) {
+            // As many documents as the batch size and the free KV blocks allow, at least one
+            size_t free_positions = kv_pool->free_blocks() * block_size;
+            size_t doc_end = doc;
+            size_t reserved = 0;
+            while (doc_end < documents.size() && doc_end - doc < std::max<size_t>(options.documents_per_batch, 1)) {
+                size_t n = std::min(documents[doc_end].size(), config.max_positions);
+                if (n == 0) {
+                    throw std::invalid_argument("Document must contain at least one token");
+                }
+                size_t positions = (n + block_size - 1) / block_size * block_size;
+                if (doc_end > doc && reserved + positions > free_positions) {
+                    break;
+                }
+                reserved += positions;
+                doc_end++;
+            }
+
+            size_t count = doc_end - doc;
+            std::vector<size_t> lengths(count);
+            std::vector<Activations> sums(count);
+            std::vector<KVCache> caches;
+            caches.reserve(count);
+            size_t longest = 0;
+            for (size_t i = 0; i < count; ++i) {
+                lengths[i] = std::min(documents[doc + i].size(), config.max_positions);
+                sums[i].assign(lengths[i] * d, 0.0f);
+                caches.push_back(create_cache());
+                longest = std::max(longest, lengths[i]);
+            }
+
+            for (size_t start = 0; start < longest; start += config.prefill_chunk_size) {
+                std::vector<BatchItem> batch;
+                std::vector<size_t> members;
+                for (size_t i = 0; i < count; ++i) {
+                    if (start < lengths[i]) {
+                        size_t chunk = std::min(config.prefill_chunk_size, lengths[i] - start);
+                        batch.push_back(BatchItem{&caches[i], documents[doc + i].data() + start, chunk, nullptr});
+                        members.push_back(i);
+                    }
+                }
+
+                Activations normed;
+                run_blocks(batch, nullptr, last, [&](size_t index, const float* x) {
+                    if (index < first) {
+                        return;
+                    }
+                    size_t rows = 0;
+                    for (const BatchItem& item : batch) {
+                        rows += item.n;
+                    }
+                    if (final_norm && index == config.num_layers) {
+                        normed.resize(rows * d);
+                        wait_for(head_ready);
+                        layernorm.forward(x, ln_f_weight.data(), ln_f_bias.data(), rows, d, normed.data());
+                        x = normed.data();
+                    }
+
+                    size_t offset = 0;
+                    for (size_t b = 0; b < batch.size(); ++b) {
+                        float* sum = sums[members[b]].data() + start * d;
+                        const float* rows_in = x + offset * d;
+                        for (size_t j = 0; j < batch[b].n * d; ++j) {
+                            sum[j] += rows_in[j];
+                        }
+                        offset += batch[b].n;
+                    }
+                });
+            }
+            caches.clear();
+
+            std::vector<float> features(d);
+            for (size_t i = 0; i < count; ++i) {
+                const float* sum = sums[i].data();
+                size_t n = lengths[i];
+                if (options.pooling == Pooling::PerToken) {
+                    for (size_t t = 0; t < n; ++t) {
+                        for (size_t j = 0; j < d; ++j) {
+                            features[j] = sum[t * d + j] * layer_scale;
+                        }
+                        write(out_row++, features.data());
+                    }
+                    continue;
+                }
+
+                if (options.pooling == Pooling::LastToken) {
+                    for (size_t j = 0; j < d; ++j) {
+                        features[j] = sum[(n - 1) * d + j] * layer_scale;
+                    }
+                } else {
+                    std::fill(features.begin(), features.end(), 0.0f);
+                    for (size_t t = 0; t < n; ++t) {
+                        for (size_t j = 0; j < d; ++j) {
+                            features[j] += sum[t * d + j];
+                        }
+                    }
+                    for (size_t j = 0; j < d; ++j) {
+                        features[j] *= layer_scale / static_cast<float>(n);
+                    }
+                }
+                write(out_row++, features.data());
+            }
+
+            doc = doc_end;
+        }
+    }
+
+    // log_softmax(lm_head(ln_f(hidden[r])))[targets[r]] for rows hidden states [rows, d_model].
+    // Rows go through the head in small groups so only [group, vocab_size] logits are alive.
+    void target_log_probs(const float* hidden, const int* targets, size_t rows, float* log_probs) {
+        const size_t group = 16;
+        size_t vocab = config.vocab_size;
+        Activations logits(group * vocab);
+
+        for (size_t start = 0; start < rows; start += group) {
+            size_t n = std::min(group, rows - start);
+            run_head(hidden + start * config.d_model, n, logits.data());
+            pool.parallel_for(n, [&](size_t begin, size_t end) {
+                for (size_t r = begin; r < end; ++r) {
+                    const float* row = logits.data() + r * vocab;
+                    log_probs[start + r] = row[targets[start + r]] - sampling::log_sum_exp(row, vocab);
+                }
+            });
+        }
+    }
+
+    // Runs a prompt into an empty cache, starting after the longest prefix found in the
+    // distribution cache or the prefix cache, and makes the prompt's K/V available to later requests
+    void prefill(const int* tokens, size_t n, KVCache& cache, float* logits,
+                 const InterruptCheck& interrupted = nullptr, bool approximate = false, int top_k = 0) {
+        std::vector<int> top_ids;
+        std::vector<float> top_logits;
+        size_t reused = 0;
+        bool repeat = false;
+        if (distribution_cache) {
+            reused = distribution_cache->lookup(tokens, n, cache, top_ids, top_logits);
+            repeat = reused == n;
+            if (repeat) {
+                if (approximate && top_k > 0 && static_cast<size_t>(top_k) <= distribution_cache->top_n()) {
+                    keep_only(top_ids, top_logits.data(), logits);
+                    return;
+                }
+                // Exact logits: the stored K/V covers the prompt, only its last token runs again
+                reused = n - 1;
+                cache.resize(reused);
+            }
+        }
+        if (reused == 0 && prefix_cache) {
+            reused = prefix_cache->restore(tokens, n - 1, cache);
+        }
+
+        run_cached(tokens + reused, n - reused, cache, logits, interrupted, approximate);
+        if (prefix_cache) {
+            prefix_cache->insert(tokens, n, cache);
+        }
+        if (distribution_cache && !repeat) {
+            top_ids = sampling::top_k_indices(logits, config.vocab_size, distribution_cache->top_n());
+            distribution_cache->insert(tokens, n, cache, top_ids, logits);
+        }
+    }
+
+    // Tokens after the pinned prefix that stay when the window shifts, stride positions short of full
+    size_t window_tail() const {
+        size_t room = config.max_positions - std::min(config.pinned_tokens, config.max_positions);
+        return room > config.context_stride ? room - config.context_stride : std::max<size_t>(room, 1);
+    }
+
+    // logits [vocab_size] = values at ids, -inf everywhere else
+    void keep_only(const std::vector<int>& ids, const float* values, float* logits) const {
+        std::fill(logits, logits + config.vocab_size, -std::numeric_limits<float>::infinity());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            logits[ids[i]] = values[i];
+        }
+    }
+
+    static void add_inplace(float* x, const Activations& y) {
+        for (size_t i = 0; i < y.size(); ++i) {
+            x[i] += y[i];
+        }
+    }
+
+    int sample_top_k(const float* logits, int k) {
+        return sampling::sample_top_k(logits, config.vocab_size, k, 1.0f, rng);
+    }
+};
+
+// GPT-2 variant named by its shape type, the config is built from the shape and the
+// checkpoint is validated against it. The kernels are the same as for GPT2: the cached
+// attention already takes its fixed 64 wide head path for every released shape.
+template <class Shape>
+class GPT2Variant : public GPT2 {
+public:
+    using shape = Shape;
+
+    GPT2Variant(const std::string& model_path, const std::string& vocab_path,
+                const WeightStorage& weight_storage = WeightStorage(),
+                size_t kv_cache_bytes = Config::default_kv_cache_bytes)
+        : GPT2(model_path, vocab_path, Config::from_shape<Shape>(weight_storage, kv_cache_bytes)) {
+    }
+};
+
+using GPT2Small = GPT2Variant<model_shapes::Small124M>;
+using GPT2Medium = GPT2Variant<model_shapes::Medium355M>;
+using GPT2Large = GPT2Variant<model_shapes::Large774M>;
+using GPT2XL = GPT2Variant<model_shapes::XL1558M>;
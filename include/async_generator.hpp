@@ -0,0 +1,386 @@
+// async_generator.hpp
+#pragma once
+#include "GPT2.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class GenerationStatus {
+    Completed,         // Reached max_new_tokens or <|endoftext|>
+    Cancelled,         // GenerationHandle::cancel, or the generator shut down
+    DeadlineExceeded,
+};
+
+struct GenerationResult {
+    std::string text;
+    size_t tokens;
+    GenerationStatus status;
+};
+
+struct GenerationRequest {
+    std::string prompt;
+    size_t max_new_tokens = 64;
+    int k = 40;
+    float temperature = 1.0f;
+    // The generation ends with DeadlineExceeded once this point is passed, the check runs
+    // between layers so an overdue prefill does not run to completion
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
+namespace detail {
+
+// State shared by a GenerationHandle and the event loop
+struct GenerationState {
+    GenerationRequest request;
+    std::atomic<bool> cancelled{false};
+
+    std::mutex mutex;
+    std::condition_variable token_ready;
+    std::deque<std::string> pending;  // Decoded tokens not yet taken by the caller
+    bool done{false};
+
+    std::promise<GenerationResult> promise;
+    std::shared_future<GenerationResult> result{promise.get_future().share()};
+
+    // Loop side, only touched by the event loop thread
+    std::vector<int> window;  // Tokens whose K/V is in cache
+    std::unique_ptr<KVCache> cache;
+    int next_token{0};  // Sampled but not yet run through the model
+    std::string text;
+    size_t generated{0};
+
+    bool cancelled_or_expired() const {
+        return cancelled.load(std::memory_order_relaxed) ||
+               std::chrono::steady_clock::now() >= request.deadline;
+    }
+};
+
+} // namespace detail
+
+// Caller's side of one generation: a stream of decoded tokens plus a future of the result
+class GenerationHandle {
+public:
+    explicit GenerationHandle(std::shared_ptr<detail::GenerationState> state) : state(std::move(state)) {
+    }
+
+    // Blocks until the next token is available. Returns false once the stream has ended.
+    bool next_token(std::string& piece) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->token_ready.wait(lock, [this] { return !state->pending.empty() || state->done; });
+        return pop(piece);
+    }
+
+    // Non-blocking variant for callers that poll from their own loop or coroutine scheduler
+    bool try_next_token(std::string& piece) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return pop(piece);
+    }
+
+    // True once no token will be added to the stream anymore
+    bool finished() const {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->done;
+    }
+
+    // Requests cancellation, the generation stops before its next layer
+    void cancel() {
+        state->cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    std::shared_future<GenerationResult> result() const {
+        return state->result;
+    }
+
+private:
+    std::shared_ptr<detail::GenerationState> state;
+
+    bool pop(std::string& piece) {
+        if (state->pending.empty()) {
+            return false;
+        }
+        piece = std::move(state->pending.front());
+        state->pending.pop_front();
+        return true;
+    }
+};
+
+// Runs many generations on one model from a single event loop thread.
+//
+// Each iteration admits at most one waiting request (its prefill), then advances every
+// running generation by one token with a single batched decode step, so all requests
+// share the model's compute pool and each weight matrix is read once per step.
+// Cancellation and deadlines are checked between layers: an abandoned prefill stops
+// early, a batched step stops once none of its generations is still wanted.
+// Context overflow follows GPT2::generate: a long prompt is cut by GPT2::fit_context and
+// a generation whose cache is full shifts its window (GPT2::append_token) in a pass of
+// its own before the batched step.
+// While the generator runs it is the only user of the model.
+class AsyncGenerator {
+public:
+    explicit AsyncGenerator(GPT2& model, size_t max_batch = 16)
+        : model(model), max_batch(std::max<size_t>(max_batch, 1)), loop([this] { run(); }) {
+    }
+
+    AsyncGenerator(const AsyncGenerator&) = delete;
+    AsyncGenerator& operator=(const AsyncGenerator&) = delete;
+
+    // Cancels whatever is still queued or running
+    ~AsyncGenerator() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        loop.join();
+    }
+
+    GenerationHandle submit(GenerationRequest request) {
+        auto state = std::make_shared<detail::GenerationState>();
+        state->request = std::move(request);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(state);
+        }
+        wake.notify_one();
+        return GenerationHandle(state);
+    }
+
+    // Requests waiting for their prefill plus the ones being decoded
+    size_t in_flight() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size() + active_count;
+    }
+
+private:
+    using State = std::shared_ptr<detail::GenerationState>;
+
+    GPT2& model;
+    size_t max_batch;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<State> queue;
+    size_t active_count{0};
+    bool stopping{false};
+
+    std::vector<State> active;  // Loop thread only
+    std::mt19937 rng{std::random_device{}()};
+    std::thread loop;  // Last member, it starts running in the constructor
+
+    void run() {
+        while (true) {
+            State admitted;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !queue.empty() || !active.empty(); });
+                if (stopping) {
+                    break;
+                }
+                if (!queue.empty() && active.size() < max_batch) {
+                    admitted = std::move(queue.front());
+                    queue.pop_front();
+                }
+            }
+
+            if (admitted) {
+                start(admitted);
+            }
+            step();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            active_count = active.size();
+        }
+
+        std::deque<State> abandoned;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            abandoned.swap(queue);
+        }
+        for (const State& state : abandoned) {
+            finish(*state, GenerationStatus::Cancelled);
+        }
+        for (const State& state : active) {
+            finish(*state, GenerationStatus::Cancelled);
+        }
+        active.clear();
+    }
+
+    // Prefills a new request and samples its first token
+    void start(const State& state) {
+        try {
+            if (state->cancelled_or_expired()) {
+                finish(*state, status_of(*state));
+                return;
+            }
+            state->window = model.fit_context(model.tokenize(state->request.prompt));
+            state->cache = std::make_unique<KVCache>(model.create_cache());
+
+            std::vector<float> logits(model.model_config().vocab_size);
+            detail::GenerationState* raw = state.get();
+            model.prefill(state->window, *state->cache, logits.data(),
+                [raw] { return raw->cancelled_or_expired(); }, true, state->request.k);
+
+            if (accept(*state, logits.data())) {
+                active.push_back(state);
+            }
+        } catch (const GenerationInterrupted&) {
+            finish(*state, status_of(*state));
+        } catch (...) {
+            fail(*state, std::current_exception());
+        }
+    }
+
+    // Runs the pending token of every active generation, in one batched pass for all
+    // but the ones whose context window has to shift first
+    void step() {
+        // Drop the generations nobody waits for before spending a pass on them
+        retire([](detail::GenerationState& state) { return state.cancelled_or_expired(); });
+        if (active.empty()) {
+            return;
+        }
+
+        size_t vocab = model.model_config().vocab_size;
+        std::vector<const float*> rows(active.size(), nullptr);  // Null for the generations that ended
+        std::vector<std::vector<float>> shifted_logits;
+        std::vector<float> batch_logits;
+
+        std::vector<size_t> batched;
+        for (size_t i = 0; i < active.size(); ++i) {
+            detail::GenerationState& state = *active[i];
+            if (state.cache->size() < model.model_config().max_positions) {
+                batched.push_back(i);
+                continue;
+            }
+            detail::GenerationState* raw = &state;
+            try {
+                std::vector<float> row(vocab);
+                model.append_token(state.window, state.next_token, *state.cache, row.data(),
+                    [raw] { return raw->cancelled_or_expired(); }, true);
+                shifted_logits.push_back(std::move(row));
+                rows[i] = shifted_logits.back().data();
+            } catch (const GenerationInterrupted&) {
+                finish(state, status_of(state));
+            } catch (...) {
+                fail(state, std::current_exception());
+            }
+        }
+
+        if (!batched.empty()) {
+            std::vector<int> tokens;
+            std::vector<KVCache*> caches;
+            for (size_t i : batched) {
+                tokens.push_back(active[i]->next_token);
+                caches.push_back(active[i]->cache.get());
+            }
+            batch_logits.resize(batched.size() * vocab);
+            try {
+                model.decode_batch(tokens, caches, batch_logits.data(), [this, &batched] {
+                    return std::all_of(batched.begin(), batched.end(),
+                        [this](size_t i) { return active[i]->cancelled_or_expired(); });
+                }, true);
+                for (size_t b = 0; b < batched.size(); ++b) {
+                    detail::GenerationState& state = *active[batched[b]];
+                    state.window.push_back(state.next_token);
+                    rows[batched[b]] = batch_logits.data() + b * vocab;
+                }
+            } catch (const GenerationInterrupted&) {
+                for (size_t i : batched) {
+                    finish(*active[i], status_of(*active[i]));
+                }
+            } catch (...) {
+                std::exception_ptr error = std::current_exception();
+                for (size_t i : batched) {
+                    fail(*active[i], error);
+                }
+            }
+        }
+
+        std::vector<State> running;
+        for (size_t i = 0; i < active.size(); ++i) {
+            if (rows[i] && accept(*active[i], rows[i])) {
+                running.push_back(std::move(active[i]));
+            }
+        }
+        active = std::move(running);
+    }
+
+    // Samples the next token from logits and streams it.
+    // Returns false once the generation is complete.
+    bool accept(detail::GenerationState& state, const float* logits) {
+        const GenerationRequest& request = state.request;
+        if (state.generated >= request.max_new_tokens) {
+            finish(state, GenerationStatus::Completed);
+            return false;
+        }
+
+        int token = sampling::sample_top_k(
+            logits, model.model_config().vocab_size, request.k, request.temperature, rng);
+        if (token == GPT2Tokenizer::end_of_text) {
+            finish(state, GenerationStatus::Completed);
+            return false;
+        }
+
+        std::string piece = model.detokenize({token});
+        state.text += piece;
+        state.generated++;
+        state.next_token = token;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.pending.push_back(std::move(piece));
+        }
+        state.token_ready.notify_all();
+
+        if (state.generated >= request.max_new_tokens) {
+            finish(state, GenerationStatus::Completed);
+            return false;
+        }
+        return true;
+    }
+
+    template <class Predicate>
+    void retire(Predicate should_retire) {
+        std::vector<State> running;
+        for (State& state : active) {
+            if (should_retire(*state)) {
+                finish(*state, status_of(*state));
+            } else {
+                running.push_back(std::move(state));
+            }
+        }
+        active = std::move(running);
+    }
+
+    static GenerationStatus status_of(const detail::GenerationState& state) {
+        return state.cancelled.load(std::memory_order_relaxed)
+            ? GenerationStatus::Cancelled : GenerationStatus::DeadlineExceeded;
+    }
+
+    static void finish(detail::GenerationState& state, GenerationStatus status) {
+        state.cache.reset();  // Hand the KV blocks back to the pool right away
+        state.promise.set_value(GenerationResult{state.text, state.generated, status});
+        close(state);
+    }
+
+    static void fail(detail::GenerationState& state, std::exception_ptr error) {
+        state.cache.reset();
+        state.promise.set_exception(error);
+        close(state);
+    }
+
+    static void close(detail::GenerationState& state) {
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.done = true;
+        }
+        state.token_ready.notify_all();
+    }
+};
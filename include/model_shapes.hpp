@@ -0,0 +1,28 @@
+// model_shapes.hpp
+#pragma once
+#include <cstddef>
+
+// Dimensions of the released GPT-2 checkpoints, fixed at compile time.
+// All of them use 64 wide attention heads, d_ff = 4 * d_model, 1024 positions
+// and the same 50257 token vocabulary.
+namespace model_shapes {
+
+template <size_t Layers, size_t Heads, size_t DModel, size_t Positions = 1024, size_t Vocab = 50257>
+struct ModelShape {
+    static_assert(DModel % Heads == 0, "d_model must be divisible by the number of heads");
+
+    static constexpr size_t num_layers = Layers;
+    static constexpr size_t num_heads = Heads;
+    static constexpr size_t d_model = DModel;
+    static constexpr size_t head_dim = DModel / Heads;
+    static constexpr size_t d_ff = 4 * DModel;
+    static constexpr size_t max_positions = Positions;
+    static constexpr size_t vocab_size = Vocab;
+};
+
+using Small124M = ModelShape<12, 12, 768>;   // gpt2
+using Medium355M = ModelShape<24, 16, 1024>; // gpt2-medium
+using Large774M = ModelShape<36, 20, 1280>;  // gpt2-large
+using XL1558M = ModelShape<48, 25, 1600>;    // gpt2-xl
+
+} // namespace model_shapes
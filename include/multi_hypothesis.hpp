@@ -0,0 +1,231 @@
+// multi_hypothesis.hpp
+#pragma once
+#include "GPT2.hpp"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Decodes several hypotheses of one prompt together: beam search and n-best sampling.
+//
+// The prompt is prefilled once. Every hypothesis forks the prompt's KV cache, so the
+// prompt's blocks are shared copy-on-write and only the block a hypothesis writes into
+// gets copied. All live hypotheses advance in one batched decode step (GPT2::decode_batch).
+// The generated tokens of a hypothesis are a linked list shared with its ancestors,
+// pruning or extending a beam never copies its history.
+class MultiHypothesisDecoder {
+public:
+    struct Completion {
+        std::vector<int> tokens;  // Generated tokens, without the prompt
+        std::string text;
+        float log_prob;           // Sum of the log-probabilities of the generated tokens
+        bool finished;            // Stopped on <|endoftext|> rather than on the token limit
+    };
+
+    explicit MultiHypothesisDecoder(GPT2& model) : model(model) {
+    }
+
+    // Beam search keeping the beam_width best hypotheses at every step.
+    // Returns the completions best first, ranked by log_prob / length^length_penalty.
+    std::vector<Completion> beam_search(
+        const std::string& prompt,
+        size_t beam_width,
+        size_t max_new_tokens,
+        float length_penalty = 1.0f
+    ) {
+        if (beam_width == 0) {
+            throw std::invalid_argument("Beam width must be positive");
+        }
+
+        std::vector<Completion> completions;
+        if (max_new_tokens == 0) {
+            return completions;  // Nothing to expand, not even a prefill
+        }
+
+        size_t vocab = model.model_config().vocab_size;
+        std::vector<float> logits(vocab);
+        KVCache prompt_cache = start(prompt, max_new_tokens, logits);
+        std::vector<Hypothesis> live;
+
+        // The first expansion comes straight from the prompt's logits
+        float lse = sampling::log_sum_exp(logits.data(), vocab);
+        for (int token : sampling::top_k_indices(logits.data(), vocab, beam_width)) {
+            Hypothesis hypothesis{nullptr, prompt_cache.fork(), 0.0f, 0};
+            extend(hypothesis, token, logits[token] - lse, completions);
+            if (hypothesis.tail) {
+                live.push_back(std::move(hypothesis));
+            }
+        }
+        prompt_cache.clear();
+
+        struct Candidate {
+            size_t parent;
+            int token;
+            float log_prob;
+        };
+
+        while (!live.empty() && live.front().length < max_new_tokens) {
+            std::vector<float> step_logits = step(live);
+
+            std::vector<Candidate> candidates;
+            candidates.reserve(live.size() * beam_width);
+            for (size_t b = 0; b < live.size(); ++b) {
+                const float* row = step_logits.data() + b * vocab;
+                float row_lse = sampling::log_sum_exp(row, vocab);
+                for (int token : sampling::top_k_indices(row, vocab, beam_width)) {
+                    candidates.push_back(Candidate{b, token, live[b].log_prob + row[token] - row_lse});
+                }
+            }
+
+            size_t keep = std::min(beam_width, candidates.size());
+            std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(),
+                [](const Candidate& a, const Candidate& b) { return a.log_prob > b.log_prob; });
+
+            // Children share their parent's blocks, the parents are dropped right after
+            // so a block is only copied when two surviving children write into it
+            std::vector<Hypothesis> next;
+            for (size_t c = 0; c < keep; ++c) {
+                const Hypothesis& parent = live[candidates[c].parent];
+                Hypothesis child{parent.tail, parent.cache.fork(), parent.log_prob, parent.length};
+                extend(child, candidates[c].token, candidates[c].log_prob - parent.log_prob, completions);
+                if (child.tail && child.length == parent.length + 1) {
+                    next.push_back(std::move(child));
+                }
+            }
+            live = std::move(next);
+        }
+
+        for (const Hypothesis& hypothesis : live) {
+            completions.push_back(to_completion(hypothesis, false));
+        }
+
+        auto score = [length_penalty](const Completion& c) {
+            float length = static_cast<float>(std::max<size_t>(c.tokens.size(), 1));
+            return c.log_prob / std::pow(length, length_penalty);
+        };
+        std::sort(completions.begin(), completions.end(),
+            [&score](const Completion& a, const Completion& b) { return score(a) > score(b); });
+        if (completions.size() > beam_width) {
+            completions.resize(beam_width);
+        }
+        return completions;
+    }
+
+    // n independent top-k samples of the same prompt, sharing one prefill
+    std::vector<Completion> sample(
+        const std::string& prompt,
+        size_t n,
+        size_t max_new_tokens,
+        int k,
+        float temperature = 1.0f
+    ) {
+        size_t vocab = model.model_config().vocab_size;
+        std::vector<float> logits(vocab);
+        KVCache prompt_cache = start(prompt, max_new_tokens, logits);
+
+        std::vector<Completion> completions;
+        std::vector<Hypothesis> live;
+
+        float lse = sampling::log_sum_exp(logits.data(), vocab);
+        for (size_t i = 0; i < n && max_new_tokens > 0; ++i) {
+            int token = sampling::sample_top_k(logits.data(), vocab, k, temperature, rng);
+            Hypothesis hypothesis{nullptr, prompt_cache.fork(), 0.0f, 0};
+            extend(hypothesis, token, logits[token] - lse, completions);
+            if (hypothesis.tail) {
+                live.push_back(std::move(hypothesis));
+            }
+        }
+        prompt_cache.clear();
+
+        while (!live.empty()) {
+            std::vector<Hypothesis> next;
+
+            if (live.front().length < max_new_tokens) {
+                std::vector<float> step_logits = step(live);
+                for (size_t b = 0; b < live.size(); ++b) {
+                    const float* row = step_logits.data() + b * vocab;
+                    int token = sampling::sample_top_k(row, vocab, k, temperature, rng);
+                    size_t length = live[b].length;
+                    extend(live[b], token, row[token] - sampling::log_sum_exp(row, vocab), completions);
+                    if (live[b].length > length) {
+                        next.push_back(std::move(live[b]));
+                    }
+                }
+            } else {
+                for (const Hypothesis& hypothesis : live) {
+                    completions.push_back(to_completion(hypothesis, false));
+                }
+            }
+            live = std::move(next);
+        }
+
+        return completions;
+    }
+
+private:
+    struct TokenNode {
+        int token;
+        std::shared_ptr<const TokenNode> parent;
+    };
+
+    struct Hypothesis {
+        std::shared_ptr<const TokenNode> tail;  // Last generated token, not yet in the cache
+        KVCache cache;                          // Prompt and every generated token before the tail
+        float log_prob;
+        size_t length;                          // Generated tokens including the tail
+    };
+
+    GPT2& model;
+    std::mt19937 rng{std::random_device{}()};
+
+    // Prefills the prompt once, its cache is the common ancestor of every hypothesis
+    KVCache start(const std::string& prompt, size_t max_new_tokens, std::vector<float>& logits) {
+        std::vector<int> tokens = model.tokenize(prompt);
+        if (tokens.size() + max_new_tokens > model.model_config().max_positions) {
+            throw std::invalid_argument("Prompt plus max_new_tokens exceeds the model context");
+        }
+        KVCache cache = model.create_cache();
+        model.prefill(tokens, cache, logits.data());
+        return cache;
+    }
+
+    // Appends token to the hypothesis, or moves it to the completions when the token ends the text
+    void extend(Hypothesis& hypothesis, int token, float token_log_prob, std::vector<Completion>& completions) {
+        hypothesis.log_prob += token_log_prob;
+        if (token == GPT2Tokenizer::end_of_text) {
+            completions.push_back(to_completion(hypothesis, true));
+            return;
+        }
+        hypothesis.tail = std::make_shared<const TokenNode>(TokenNode{token, hypothesis.tail});
+        hypothesis.length++;
+    }
+
+    // Runs the tail token of every live hypothesis as one batched step, returns [live, vocab] logits
+    std::vector<float> step(std::vector<Hypothesis>& live) {
+        std::vector<int> tokens;
+        std::vector<KVCache*> caches;
+        for (Hypothesis& hypothesis : live) {
+            tokens.push_back(hypothesis.tail->token);
+            caches.push_back(&hypothesis.cache);
+        }
+
+        std::vector<float> logits(live.size() * model.model_config().vocab_size);
+        model.decode_batch(tokens, caches, logits.data());
+        return logits;
+    }
+
+    Completion to_completion(const Hypothesis& hypothesis, bool finished) {
+        Completion completion;
+        for (const TokenNode* node = hypothesis.tail.get(); node != nullptr; node = node->parent.get()) {
+            completion.tokens.push_back(node->token);
+        }
+        std::reverse(completion.tokens.begin(), completion.tokens.end());
+        completion.text = model.detokenize(completion.tokens);
+        completion.log_prob = hypothesis.log_prob;
+        completion.finished = finished;
+        return completion;
+    }
+};
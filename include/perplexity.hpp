@@ -0,0 +1,154 @@
+// perplexity.hpp
+#pragma once
+#include "GPT2.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Log-likelihood and perplexity of a token stream with strided sliding windows.
+//
+// Windows of window_size tokens start every stride tokens. Each window scores only the
+// tokens no earlier window has scored, so every token is scored exactly once and all but
+// the first window_size of them see at least window_size - stride tokens of context.
+// The corpus is fed incrementally with add_tokens/add_text. A batch of windows is scored as
+// soon as its tokens are buffered and then dropped, so memory stays bounded by the batch.
+class PerplexityScorer {
+public:
+    struct Report {
+        size_t scored_tokens;
+        double log_likelihood;  // Sum of the natural log-probabilities
+        double seconds;         // Spent in the model
+
+        double perplexity() const {
+            return scored_tokens ? std::exp(-log_likelihood / scored_tokens) : 0.0;
+        }
+        double tokens_per_second() const {
+            return seconds > 0.0 ? scored_tokens / seconds : 0.0;
+        }
+    };
+
+    // Receives every scored token with its log-probability, in corpus order
+    using TokenCallback = std::function<void(int token, float log_prob)>;
+
+    // window_size 0 uses the model's full context
+    PerplexityScorer(GPT2& model, size_t stride = 512, size_t window_size = 0, size_t windows_per_batch = 4)
+        : model(model),
+          window_size(window_size ? window_size : model.model_config().max_positions),
+          stride(stride),
+          windows_per_batch(std::max<size_t>(windows_per_batch, 1)) {
+        const GPT2::Config& config = model.model_config();
+        if (this->window_size > config.max_positions) {
+            throw std::invalid_argument("Window is longer than the model context");
+        }
+        // Windows have to overlap, otherwise the first token of each would go unscored
+        if (stride == 0 || stride >= this->window_size) {
+            throw std::invalid_argument("Stride must be in [1, window_size)");
+        }
+        if (this->windows_per_batch * this->window_size > config.kv_pool_positions) {
+            throw std::invalid_argument("A batch of windows does not fit into the KV block pool");
+        }
+    }
+
+    void on_token(TokenCallback callback) {
+        token_callback = std::move(callback);
+    }
+
+    void add_text(const std::string& text) {
+        add_tokens(model.tokenize(text));
+    }
+
+    void add_tokens(const std::vector<int>& tokens) {
+        buffer.insert(buffer.end(), tokens.begin(), tokens.end());
+        score_ready(false);
+    }
+
+    // Scores the tokens still buffered and returns the totals for the whole corpus
+    Report finish() {
+        score_ready(true);
+        return totals;
+    }
+
+    const Report& report() const {
+        return totals;
+    }
+
+private:
+    GPT2& model;
+    size_t window_size;
+    size_t stride;
+    size_t windows_per_batch;
+    TokenCallback token_callback;
+
+    std::vector<int> buffer;  // Corpus tokens [buffer_start, buffer_start + buffer.size())
+    size_t buffer_start{0};
+    size_t next_begin{0};     // Corpus index where the next window starts
+    size_t scored_until{1};   // First corpus token not yet scored, token 0 never is
+    Report totals{0, 0.0, 0.0};
+
+    // Scores every window whose tokens are all buffered, with final also the trailing
+    // shorter window
+    void score_ready(bool final) {
+        size_t buffer_end = buffer_start + buffer.size();
+
+        while (true) {
+            std::vector<GPT2::ScoringWindow> windows;
+            std::vector<std::vector<float>> log_probs;
+            size_t begin = next_begin;
+            size_t from = scored_until;
+
+            while (windows.size() < windows_per_batch) {
+                size_t end = begin + window_size;
+                if (end > buffer_end) {
+                    if (!final) {
+                        break;
+                    }
+                    end = buffer_end;
+                }
+                size_t score_from = std::max(from, begin + 1);
+                if (score_from >= end) {
+                    break;
+                }
+
+                log_probs.emplace_back(end - score_from);
+                windows.push_back(GPT2::ScoringWindow{
+                    buffer.data() + (begin - buffer_start), end - begin, score_from - begin, nullptr});
+                from = end;
+                begin += stride;
+            }
+            if (windows.empty()) {
+                return;
+            }
+
+            for (size_t w = 0; w < windows.size(); ++w) {
+                windows[w].log_probs = log_probs[w].data();
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            model.score_windows(windows);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            totals.seconds += elapsed.count();
+
+            for (size_t w = 0; w < windows.size(); ++w) {
+                const GPT2::ScoringWindow& window = windows[w];
+                for (size_t i = 0; i < log_probs[w].size(); ++i) {
+                    totals.log_likelihood += log_probs[w][i];
+                    if (token_callback) {
+                        token_callback(window.tokens[window.score_from + i], log_probs[w][i]);
+                    }
+                }
+                totals.scored_tokens += log_probs[w].size();
+            }
+
+            // Tokens before the next window are no longer needed
+            next_begin = begin;
+            scored_until = from;
+            size_t drop = std::min(next_begin, buffer_end) - buffer_start;
+            buffer.erase(buffer.begin(), buffer.begin() + drop);
+            buffer_start += drop;
+        }
+    }
+};
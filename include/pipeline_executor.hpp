@@ -0,0 +1,342 @@
+// pipeline_executor.hpp
+#pragma once
+#include "GPT2.hpp"
+#include "spsc_queue.hpp"
+#include "tensor_memory.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Layer-pipelined prefill for offline batch jobs.
+//
+// Running every request through all layers on all cores streams the weights of the whole
+// model through every core's caches once per request. Here the blocks are split into
+// contiguous ranges, one per stage, and every stage runs on its own group of cores with its
+// own thread pool, so a group only ever touches the weights of its own layers and keeps them
+// hot in its L2 / L3 slice. Prompts are cut into micro-batches of about micro_batch_tokens
+// rows that flow from stage to stage through bounded lock-free single-producer /
+// single-consumer queues, all stages work on different micro-batches at the same time.
+//
+// The first stage also embeds, the last one runs ln_f / lm_head on the last position of
+// every prompt. Prompts longer than the prefill chunk size are split into chunks that travel
+// in consecutive micro-batches; the queues are FIFO, so a chunk reaches every layer after
+// the chunk before it has written its K/V there.
+// Every prompt's cache is sized to the whole prompt when it is admitted, admission waits
+// while the KV block pool has no room, which bounds the memory of a run.
+class PipelineExecutor {
+public:
+    struct Options {
+        size_t stages = 0;               // Core groups, 0: one per 4 hardware threads, at most num_layers
+        size_t threads_per_stage = 0;    // 0: the hardware threads split evenly over the stages
+        size_t micro_batch_tokens = 256; // Rows a micro-batch is filled up to
+        size_t queue_depth = 2;          // Micro-batches that can wait in front of a stage
+        bool pin_threads = true;         // Pin every group to its own contiguous range of CPUs,
+                                         // needs stages * threads_per_stage <= hardware threads
+    };
+
+    struct Stats {
+        size_t prompts;
+        size_t tokens;
+        size_t micro_batches;
+        double seconds;
+
+        double tokens_per_second() const { return seconds > 0.0 ? tokens / seconds : 0.0; }
+    };
+
+    explicit PipelineExecutor(GPT2& model) : PipelineExecutor(model, Options()) {}
+
+    PipelineExecutor(GPT2& model, const Options& options) : model(model), options(options) {
+        size_t num_layers = model.model_config().num_layers;
+        size_t hardware = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        size_t stages = options.stages ? options.stages : hardware / 4;
+        stages = std::min(std::max<size_t>(stages, 1), num_layers);
+        size_t threads = options.threads_per_stage ? options.threads_per_stage
+                                                   : std::max<size_t>(hardware / stages, 1);
+        if (options.micro_batch_tokens == 0 || options.queue_depth == 0) {
+            throw std::invalid_argument("Micro-batches and queues need room for at least one entry");
+        }
+        // Pinned groups would wrap onto the CPUs of earlier groups and share their caches
+        if (options.pin_threads && stages * threads > hardware) {
+            throw std::invalid_argument(
+                "Pinned stages need stages * threads_per_stage <= " + std::to_string(hardware) +
+                " hardware threads, got " + std::to_string(stages) + " * " + std::to_string(threads));
+        }
+
+        for (size_t s = 0; s < stages; ++s) {
+            Stage stage;
+            stage.first_layer = s * num_layers / stages;
+            stage.last_layer = (s + 1) * num_layers / stages;
+            for (size_t t = 0; t < threads; ++t) {
+                stage.cpus.push_back(static_cast<unsigned>(s * threads + t));
+            }
+            stage.pool = options.pin_threads ? std::make_unique<ThreadPool>(stage.cpus)
+                                             : std::make_unique<ThreadPool>(threads);
+            pipeline.push_back(std::move(stage));
+        }
+    }
+
+    size_t stages() const { return pipeline.size(); }
+
+    // Blocks of stage s are [stage_layers(s).first, stage_layers(s).second)
+    std::pair<size_t, size_t> stage_layers(size_t s) const {
+        return {pipeline[s].first_layer, pipeline[s].last_layer};
+    }
+
+    // Prefills every prompt and hands the next-token logits of its last position [vocab_size]
+    // to on_result, in prompt order, from the thread of the last stage
+    void run(const std::vector<std::vector<int>>& prompts,
+             const std::function<void(size_t, const float*)>& on_result) {
+        const GPT2::Config& config = model.model_config();
+        for (const auto& prompt : prompts) {
+            if (prompt.empty() || prompt.size() > config.max_positions) {
+                throw std::invalid_argument("Every prompt needs between 1 and max_positions tokens");
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        Run state(pipeline.size(), options.queue_depth);
+        std::vector<std::thread> threads;
+        for (size_t s = 0; s < pipeline.size(); ++s) {
+            threads.emplace_back([this, s, &state, &on_result]() { run_stage(s, state, on_result); });
+        }
+
+        try {
+            feed(prompts, state);
+        } catch (...) {
+            state.fail(std::current_exception());
+        }
+        std::unique_ptr<MicroBatch> end;
+        push(*state.queues[0], end);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        stats.seconds += elapsed.count();
+        if (state.error) {
+            std::rethrow_exception(state.error);
+        }
+    }
+
+    // Same, the logits of prompt i go to logits + i * vocab_size
+    void run(const std::vector<std::vector<int>>& prompts, float* logits) {
+        size_t vocab = model.model_config().vocab_size;
+        run(prompts, [logits, vocab](size_t index, const float* row) {
+            std::copy(row, row + vocab, logits + index * vocab);
+        });
+    }
+
+    const Stats& statistics() const { return stats; }
+    void reset_statistics() { stats = Stats{0, 0, 0, 0.0}; }
+
+private:
+    using Activations = tensor_memory::Vector<float, tensor_memory::Category::Activations>;
+
+    struct Stage {
+        size_t first_layer;
+        size_t last_layer;
+        std::vector<unsigned> cpus;
+        std::unique_ptr<ThreadPool> pool;
+    };
+
+    // A prompt in flight, its cache lives until the micro-batch of its last chunk is done
+    struct Sequence {
+        size_t index;
+        KVCache cache;
+    };
+
+    struct MicroBatch {
+        std::vector<GPT2::StageItem> items;
+        std::vector<std::shared_ptr<Sequence>> sequences;  // Owner of items[i].cache
+        std::vector<bool> finishes;                        // items[i] is the last chunk of its prompt
+        size_t rows = 0;
+        Activations x;                                     // [rows, d_model]
+    };
+
+    using Queue = SpscQueue<std::unique_ptr<MicroBatch>>;
+
+    // State of one run, queues[s] feeds stage s, an empty micro-batch ends the stream
+    struct Run {
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::atomic<size_t> in_flight{0};
+        std::atomic<bool> failed{false};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+
+        Run(size_t stages, size_t depth) {
+            for (size_t s = 0; s < stages; ++s) {
+                queues.push_back(std::make_unique<Queue>(depth));
+            }
+        }
+
+        void fail(std::exception_ptr e) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) error = e;
+            failed = true;
+        }
+    };
+
+    GPT2& model;
+    Options options;
+    std::vector<Stage> pipeline;
+    Stats stats{0, 0, 0, 0.0};
+
+    // Spins a little, then gives the core away, the stages wait for each other this way
+    // without taking a lock
+    static void backoff(size_t& attempts) {
+        if (++attempts >= 64) {
+            std::this_thread::yield();
+        }
+    }
+
+    static void push(Queue& queue, std::unique_ptr<MicroBatch>& batch) {
+        size_t attempts = 0;
+        while (!queue.try_push(batch)) {
+            backoff(attempts);
+        }
+    }
+
+    static std::unique_ptr<MicroBatch> pop(Queue& queue) {
+        std::unique_ptr<MicroBatch> batch;
+        size_t attempts = 0;
+        while (!queue.try_pop(batch)) {
+            backoff(attempts);
+        }
+        return batch;
+    }
+
+    // Cuts the prompts into micro-batches and pushes them into the first stage
+    void feed(const std::vector<std::vector<int>>& prompts, Run& state) {
+        const GPT2::Config& config = model.model_config();
+        const KVBlockPool& kv_pool = model.kv_block_pool();
+        size_t chunk_size = config.prefill_chunk_size;
+
+        std::unique_ptr<MicroBatch> batch;
+        auto send = [&]() {
+            if (batch && !batch->items.empty()) {
+                batch->x.resize(batch->rows * config.d_model);
+                state.in_flight++;
+                push(*state.queues[0], batch);
+            }
+            batch.reset();
+        };
+
+        for (size_t p = 0; p < prompts.size() && !state.failed; ++p) {
+            const std::vector<int>& prompt = prompts[p];
+
+            // Admission: wait until the blocks of the whole prompt are free, the caches of the
+            // micro-batch being filled only come back once it has gone through
+            size_t needed = (prompt.size() + kv_pool.block_size() - 1) / kv_pool.block_size();
+            if (kv_pool.free_blocks() < needed) {
+                send();
+            }
+            size_t attempts = 0;
+            while (kv_pool.free_blocks() < needed && state.in_flight > 0 && !state.failed) {
+                backoff(attempts);
+            }
+            auto sequence = std::make_shared<Sequence>(Sequence{p, model.create_cache()});
+            sequence->cache.resize(prompt.size());
+
+            for (size_t start = 0; start < prompt.size(); start += chunk_size) {
+                size_t n = std::min(chunk_size, prompt.size() - start);
+                if (batch && batch->rows + n > options.micro_batch_tokens) {
+                    send();
+                }
+                if (!batch) {
+                    batch = std::make_unique<MicroBatch>();
+                }
+                bool last = start + n == prompt.size();
+                batch->items.push_back(GPT2::StageItem{&sequence->cache, prompt.data() + start, n, start});
+                batch->sequences.push_back(sequence);
+                batch->finishes.push_back(last);
+                batch->rows += n;
+                if (!last) {
+                    send();  // The next chunk of the prompt goes into a later micro-batch
+                }
+            }
+        }
+        send();
+    }
+
+    void run_stage(size_t s, Run& state, const std::function<void(size_t, const float*)>& on_result) {
+        Stage& stage = pipeline[s];
+        if (options.pin_threads) {
+            ThreadPool::pin_current_thread(stage.cpus[0]);
+        }
+        bool last_stage = s + 1 == pipeline.size();
+        size_t d = model.model_config().d_model;
+        size_t vocab = model.model_config().vocab_size;
+        std::vector<float> hidden, logits;
+
+        while (true) {
+            std::unique_ptr<MicroBatch> batch = pop(*state.queues[s]);
+            if (!batch) {
+                if (!last_stage) {
+                    push(*state.queues[s + 1], batch);
+                }
+                return;
+            }
+
+            // After a failure the micro-batches still drain so that no stage waits forever
+            if (!state.failed) {
+                try {
+                    if (s == 0) {
+                        model.embed_stage(batch->items, batch->x.data());
+                    }
+                    model.block_stage(batch->items, batch->x.data(), stage.first_layer, stage.last_layer, *stage.pool);
+                    if (last_stage) {
+                        finish(*batch, hidden, logits, d, vocab, on_result);
+                    }
+                } catch (...) {
+                    state.fail(std::current_exception());
+                }
+            }
+
+            if (last_stage) {
+                stats.micro_batches++;
+                stats.tokens += batch->rows;
+                batch.reset();  // Releases the caches of the finished prompts
+                state.in_flight--;
+            } else {
+                push(*state.queues[s + 1], batch);
+            }
+        }
+    }
+
+    // lm_head on the last row of every prompt that ends in this micro-batch
+    void finish(const MicroBatch& batch, std::vector<float>& hidden, std::vector<float>& logits, size_t d,
+                size_t vocab, const std::function<void(size_t, const float*)>& on_result) {
+        hidden.clear();
+        size_t row = 0;
+        for (size_t i = 0; i < batch.items.size(); ++i) {
+            row += batch.items[i].n;
+            if (batch.finishes[i]) {
+                const float* last = batch.x.data() + (row - 1) * d;
+                hidden.insert(hidden.end(), last, last + d);
+            }
+        }
+        size_t rows = hidden.size() / d;
+        if (rows == 0) {
+            return;
+        }
+
+        logits.resize(rows * vocab);
+        model.head_stage(hidden.data(), rows, logits.data(), *pipeline.back().pool);
+        size_t r = 0;
+        for (size_t i = 0; i < batch.items.size(); ++i) {
+            if (batch.finishes[i]) {
+                on_result(batch.sequences[i]->index, logits.data() + r++ * vocab);
+                stats.prompts++;
+            }
+        }
+    }
+};
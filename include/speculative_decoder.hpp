@@ -0,0 +1,188 @@
+// speculative_decoder.hpp
+#pragma once
+#include "GPT2.hpp"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Self-speculative decoding: the model is its own draft model.
+//
+// The draft is an early exit of the same weights, the first draft_blocks transformer
+// blocks followed by the shared ln_f / lm_head. It proposes draft_tokens tokens one at a
+// time, then the full model runs the pending token and all proposals in one batched pass
+// over the cached context and keeps the longest prefix that passes the rejection rule:
+// proposal d drawn from the draft distribution q is accepted with probability
+// min(1, p(d) / q(d)), on rejection the token is drawn from max(0, p - q) renormalized,
+// and when every proposal is accepted one more token comes from the last row of p.
+// The output follows the full model's top-k / temperature distribution exactly, with
+// temperature <= 0 it reduces to accepting proposals that match the full model's argmax.
+//
+// The first draft_blocks layers compute the same K/V in both models, so draft and full
+// model share one KV cache. The draft's extra positions are dropped before verification.
+// Context overflow follows GPT2::generate: a long prompt is cut by GPT2::fit_context, and
+// once the cache is full the window shifts (GPT2::append_token) with a full-model pass
+// that samples the next token without a draft round.
+class SelfSpeculativeDecoder {
+public:
+    struct Stats {
+        size_t generated;      // Tokens emitted
+        size_t drafted;        // Tokens proposed by the draft
+        size_t accepted;       // Proposals kept by the full model
+        size_t target_passes;  // Full-model passes, one per round plus the prefill
+        size_t draft_passes;   // Early-exit passes
+        double seconds;
+
+        double acceptance_rate() const {
+            return drafted ? static_cast<double>(accepted) / drafted : 0.0;
+        }
+        // Tokens per full-model pass, what plain decoding gets as 1
+        double tokens_per_target_pass() const {
+            return target_passes ? static_cast<double>(generated) / target_passes : 0.0;
+        }
+    };
+
+    SelfSpeculativeDecoder(GPT2& model, size_t draft_blocks, size_t draft_tokens)
+        : model(model), draft_blocks(draft_blocks), draft_tokens(draft_tokens) {
+        if (draft_blocks == 0 || draft_blocks >= model.model_config().num_layers) {
+            throw std::invalid_argument("The draft needs between 1 and num_layers - 1 blocks");
+        }
+        if (draft_tokens == 0) {
+            throw std::invalid_argument("The draft has to propose at least one token");
+        }
+    }
+
+    // Same contract as GPT2::generate: on_token receives every decoded token and stops
+    // the generation by returning false
+    std::string generate(
+        const std::string& prompt,
+        size_t max_new_tokens,
+        int k,
+        float temperature = 1.0f,
+        const std::function<bool(const std::string&)>& on_token = nullptr
+    ) {
+        auto start = std::chrono::steady_clock::now();
+        const GPT2::Config& config = model.model_config();
+        size_t vocab = config.vocab_size;
+
+        std::vector<int> window = model.fit_context(model.tokenize(prompt));  // Tokens whose K/V is in cache
+        KVCache cache = model.create_cache();
+        std::vector<float> logits((draft_tokens + 1) * vocab);
+        model.prefill(window, cache, logits.data());
+        stats.target_passes++;
+
+        std::string text;
+        bool stopped = max_new_tokens == 0;
+        auto emit = [&](int token) {
+            std::string piece = model.detokenize({token});
+            text += piece;
+            stats.generated++;
+            if ((on_token && !on_token(piece)) || --max_new_tokens == 0) {
+                stopped = true;
+            }
+        };
+
+        // Sampled but not yet run through the model
+        int pending = stopped ? 0 : draw(distribution(logits.data(), k, temperature));
+        if (!stopped) {
+            emit(pending);
+        }
+
+        std::vector<std::vector<float>> draft(draft_tokens);
+        std::vector<int> run;
+        while (!stopped) {
+            if (cache.size() >= config.max_positions) {
+                model.append_token(window, pending, cache, logits.data());
+                stats.target_passes++;
+                pending = draw(distribution(logits.data(), k, temperature));
+                emit(pending);
+                continue;
+            }
+            size_t base = cache.size();
+            size_t count = std::min({draft_tokens, max_new_tokens - 1, config.max_positions - base - 1});
+
+            // Draft: early-exit passes, one proposal each
+            run.assign(1, pending);
+            for (size_t j = 0; j < count; ++j) {
+                model.forward_logits(&run.back(), 1, cache, logits.data(), draft_blocks);
+                draft[j] = distribution(logits.data(), k, temperature);
+                run.push_back(draw(draft[j]));
+            }
+            stats.draft_passes += count;
+            stats.drafted += count;
+
+            // Verify: the pending token and every proposal in one full pass
+            cache.resize(base);
+            model.forward_logits(run.data(), run.size(), cache, logits.data());
+            stats.target_passes++;
+
+            size_t accepted = 0;
+            int next = -1;
+            for (; accepted < count; ++accepted) {
+                std::vector<float> p = distribution(logits.data() + accepted * vocab, k, temperature);
+                const std::vector<float>& q = draft[accepted];
+                int proposal = run[accepted + 1];
+                if (uniform(rng) * q[proposal] < p[proposal]) {
+                    continue;
+                }
+
+                // Rejected, the token comes from the part of p the draft under-covers
+                std::vector<float> residual(vocab);
+                float mass = 0.0f;
+                for (size_t t = 0; t < vocab; ++t) {
+                    residual[t] = std::max(0.0f, p[t] - q[t]);
+                    mass += residual[t];
+                }
+                next = draw(mass > 0.0f ? residual : p);
+                break;
+            }
+            if (next < 0) {
+                next = draw(distribution(logits.data() + count * vocab, k, temperature));
+            }
+            stats.accepted += accepted;
+
+            // Positions of the pending token and the accepted proposals stay
+            cache.resize(base + 1 + accepted);
+            window.insert(window.end(), run.begin(), run.begin() + 1 + accepted);
+            for (size_t j = 1; j <= accepted && !stopped; ++j) {
+                emit(run[j]);
+            }
+            if (!stopped) {
+                emit(next);
+            }
+            pending = next;
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        stats.seconds += elapsed.count();
+        return text;
+    }
+
+    const Stats& statistics() const {
+        return stats;
+    }
+
+    void reset_statistics() {
+        stats = Stats{0, 0, 0, 0, 0, 0.0};
+    }
+
+private:
+    GPT2& model;
+    size_t draft_blocks;
+    size_t draft_tokens;
+    Stats stats{0, 0, 0, 0, 0, 0.0};
+    std::mt19937 rng{std::random_device{}()};
+    std::uniform_real_distribution<float> uniform{0.0f, 1.0f};
+
+    std::vector<float> distribution(const float* logits, int k, float temperature) const {
+        return sampling::top_k_distribution(logits, model.model_config().vocab_size, k, temperature);
+    }
+
+    int draw(const std::vector<float>& probs) {
+        std::discrete_distribution<int> dist(probs.begin(), probs.end());
+        return dist(rng);
+    }
+};
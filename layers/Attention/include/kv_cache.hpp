@@ -0,0 +1,134 @@
+// kv_cache.hpp
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "tensor_memory.hpp"
+
+// Fixed size pages of key/value storage shared by all sequences.
+//
+// A block holds block_size consecutive positions of every layer, laid out as
+// [layers, 2 (K, V), block_size, d_model] so that the keys of one layer inside a block
+// are contiguous rows. The storage is reserved once up front but left untouched, so the
+// OS only commits the pages of blocks that sequences actually write to. The memory report
+// shows the pool as reserved kv_cache memory and the blocks handed out as current.
+class KVBlockPool {
+public:
+    static constexpr size_t default_block_size = 16;
+
+    KVBlockPool(size_t num_layers, size_t d_model, size_t num_blocks, size_t block_size = default_block_size);
+
+    ~KVBlockPool();
+
+    KVBlockPool(const KVBlockPool&) = delete;
+    KVBlockPool& operator=(const KVBlockPool&) = delete;
+
+    // Takes a free block. With the free list empty the reclaim hook runs first, throws
+    // std::runtime_error when the pool is still exhausted.
+    size_t allocate();
+    // Adds an owner to a block that is already in use
+    void retain(size_t block);
+    // Drops one owner, the block goes back to the free list when no owner is left
+    void release(size_t block);
+    size_t ref_count(size_t block) const;
+    // Copies the contents of every layer of block src into block dst
+    void copy_block(size_t src, size_t dst);
+
+    float* key_block(size_t block, size_t layer) { return storage.get() + offset(block, layer, 0); }
+    float* value_block(size_t block, size_t layer) { return storage.get() + offset(block, layer, 1); }
+    const float* key_block(size_t block, size_t layer) const { return storage.get() + offset(block, layer, 0); }
+    const float* value_block(size_t block, size_t layer) const { return storage.get() + offset(block, layer, 1); }
+
+    size_t block_size() const { return positions_per_block; }
+    size_t num_layers() const { return layers; }
+    size_t width() const { return d_model; }
+    size_t total_blocks() const { return ref_counts.size(); }
+    // Bytes of one block, every layer's keys and values for block_size positions
+    size_t block_bytes() const { return layers * 2 * positions_per_block * d_model * sizeof(float); }
+    size_t free_blocks() const;
+
+    // Called by allocate while no block is free, for owners that only keep blocks as a
+    // cache. Returns false once it has nothing left to give up. Runs without the pool's
+    // lock held, so it may release blocks; set it before sequences use the pool.
+    void set_reclaim(std::function<bool()> hook);
+
+private:
+    size_t layers;
+    size_t d_model;
+    size_t positions_per_block;
+    tensor_memory::Buffer<float> storage;  // [num_blocks, layers, 2, block_size, d_model]
+    std::vector<uint32_t> ref_counts;
+    std::vector<size_t> free_list;
+    std::function<bool()> reclaim;
+    mutable std::mutex mutex;
+
+    size_t offset(size_t block, size_t layer, size_t kv) const {
+        return ((block * layers + layer) * 2 + kv) * positions_per_block * d_model;
+    }
+};
+
+// Keys and values of every layer for the positions of one sequence seen so far.
+// Rows are [d_model] wide with the heads side by side, the same layout as the
+// K and V thirds of the c_attn projection, so head h of a position starts at h * d_k.
+// The positions live in blocks taken from a KVBlockPool, the block table maps
+// position p to block blocks[p / block_size], row p % block_size.
+// Forked caches share their blocks copy-on-write: a shared block is only copied
+// once one of the sequences writes into it.
+class KVCache {
+public:
+    KVCache(std::shared_ptr<KVBlockPool> pool, size_t max_positions);
+    // Stand-alone cache with its own pool, large enough for max_positions
+    KVCache(size_t num_layers, size_t d_model, size_t max_positions);
+    ~KVCache();
+
+    KVCache(const KVCache&) = delete;
+    KVCache& operator=(const KVCache&) = delete;
+    KVCache(KVCache&& other) noexcept;
+    KVCache& operator=(KVCache&& other) noexcept;
+
+    // Number of positions held by the cache
+    size_t size() const { return length; }
+    size_t max_size() const { return max_positions; }
+    size_t num_layers() const { return pool->num_layers(); }
+    size_t width() const { return pool->width(); }
+    size_t block_size() const { return pool->block_size(); }
+
+    // Grows or shrinks the number of positions. Blocks are taken from the pool as the
+    // sequence grows and handed back as soon as they are no longer covered.
+    // The rows of new positions are filled in by MultiHeadAttention::forward_cached.
+    void resize(size_t positions);
+    void clear() { resize(0); }
+
+    // A second sequence with the same history, sharing every block with this one
+    KVCache fork() const;
+
+    // Gives this sequence its own copy of every shared block holding positions >= pos,
+    // done by resize for the positions it adds
+    void make_writable(size_t pos);
+
+    // Rows of a single position
+    float* key(size_t layer, size_t pos) { return row(pool->key_block(blocks[pos / block_size()], layer), pos); }
+    float* value(size_t layer, size_t pos) { return row(pool->value_block(blocks[pos / block_size()], layer), pos); }
+    const float* key(size_t layer, size_t pos) const { return row(cpool().key_block(blocks[pos / block_size()], layer), pos); }
+    const float* value(size_t layer, size_t pos) const { return row(cpool().value_block(blocks[pos / block_size()], layer), pos); }
+
+    // First row of the index-th block of the sequence, the block_size rows that follow are contiguous
+    const float* key_block(size_t layer, size_t index) const { return cpool().key_block(blocks[index], layer); }
+    const float* value_block(size_t layer, size_t index) const { return cpool().value_block(blocks[index], layer); }
+
+    const std::vector<size_t>& block_table() const { return blocks; }
+
+private:
+    std::shared_ptr<KVBlockPool> pool;
+    size_t max_positions;
+    size_t length{0};
+    std::vector<size_t> blocks;
+
+    const KVBlockPool& cpool() const { return *pool; }
+    template <class T>
+    T* row(T* block, size_t pos) const { return block + (pos % block_size()) * width(); }
+    void release_all();
+};
@@ -1,8 +1,11 @@
 #pragma once
 #include "scaled_dot_attention.hpp"
+#include "kv_cache.hpp"
 #include <xtensor/xarray.hpp>
 #include <vector>
 
+class ThreadPool;
+
 class MultiHeadAttention {
 public:
 
@@ -25,6 +28,20 @@ public:
         const xt::xarray<float>* mask = nullptr
     );
 
+    // Incremental attention for the decode path.
+    // qkv holds the c_attn projections [n_tokens, 3 * d_model] of positions base_pos .. base_pos + n_tokens - 1.
+    // Their keys and values are written to the cache, then token i attends causally to the
+    // cached positions [0, base_pos + i]. output receives the combined heads [n_tokens, d_model].
+    void forward_cached(
+        const float* qkv,
+        size_t n_tokens,
+        KVCache& cache,
+        size_t layer,
+        size_t base_pos,
+        float* output,
+        ThreadPool* pool = nullptr
+    ) const;
+
 private:
     size_t num_heads;
     size_t d_model;
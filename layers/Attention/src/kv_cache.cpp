@@ -0,0 +1,187 @@
+#include "kv_cache.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+KVBlockPool::KVBlockPool(size_t num_layers, size_t d_model, size_t num_blocks, size_t block_size)
+    : layers(num_layers), d_model(d_model), positions_per_block(block_size),
+      // Not value initialized on purpose, untouched blocks never get committed by the OS.
+      // The pool counts as reserved KV memory, blocks count as in use while they are handed out.
+      storage(tensor_memory::make_reserved_buffer<float>(num_blocks * num_layers * 2 * block_size * d_model,
+                                                         tensor_memory::Category::KVCache)),
+      ref_counts(num_blocks, 0) {
+    if (block_size == 0) {
+        throw std::invalid_argument("KV block size must be positive");
+    }
+    // Hand out low block indices first
+    free_list.reserve(num_blocks);
+    for (size_t i = num_blocks; i > 0; --i) {
+        free_list.push_back(i - 1);
+    }
+}
+
+KVBlockPool::~KVBlockPool() {
+    tensor_memory::release_reserved((ref_counts.size() - free_list.size()) * block_bytes(),
+                                    tensor_memory::Category::KVCache);
+}
+
+size_t KVBlockPool::allocate() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (free_list.empty() && reclaim) {
+        std::function<bool()> hook = reclaim;
+        lock.unlock();
+        bool reclaimed = hook();
+        lock.lock();
+        if (!reclaimed) {
+            break;
+        }
+    }
+    if (free_list.empty()) {
+        throw std::runtime_error(
+            "KV block pool exhausted (" + std::to_string(ref_counts.size()) + " blocks of " +
+            std::to_string(positions_per_block) + " positions)");
+    }
+    size_t block = free_list.back();
+    free_list.pop_back();
+    ref_counts[block] = 1;
+    tensor_memory::use_reserved(block_bytes(), tensor_memory::Category::KVCache);
+    return block;
+}
+
+void KVBlockPool::retain(size_t block) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ref_counts[block] == 0) {
+        throw std::logic_error("Cannot retain a free KV block");
+    }
+    ref_counts[block]++;
+}
+
+void KVBlockPool::release(size_t block) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ref_counts[block] == 0) {
+        throw std::logic_error("KV block released twice");
+    }
+    if (--ref_counts[block] == 0) {
+        free_list.push_back(block);
+        tensor_memory::release_reserved(block_bytes(), tensor_memory::Category::KVCache);
+    }
+}
+
+size_t KVBlockPool::ref_count(size_t block) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ref_counts[block];
+}
+
+void KVBlockPool::copy_block(size_t src, size_t dst) {
+    size_t block_floats = block_bytes() / sizeof(float);
+    std::copy_n(storage.get() + src * block_floats, block_floats, storage.get() + dst * block_floats);
+}
+
+size_t KVBlockPool::free_blocks() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return free_list.size();
+}
+
+void KVBlockPool::set_reclaim(std::function<bool()> hook) {
+    std::lock_guard<std::mutex> lock(mutex);
+    reclaim = std::move(hook);
+}
+
+KVCache::KVCache(std::shared_ptr<KVBlockPool> pool, size_t max_positions)
+    : pool(std::move(pool)), max_positions(max_positions) {
+}
+
+KVCache::KVCache(size_t num_layers, size_t d_model, size_t max_positions)
+    : KVCache(std::make_shared<KVBlockPool>(
+                  num_layers, d_model,
+                  (max_positions + KVBlockPool::default_block_size - 1) / KVBlockPool::default_block_size),
+              max_positions) {
+}
+
+KVCache::~KVCache() {
+    release_all();
+}
+
+KVCache::KVCache(KVCache&& other) noexcept
+    : pool(std::move(other.pool)), max_positions(other.max_positions),
+      length(other.length), blocks(std::move(other.blocks)) {
+    other.length = 0;
+    other.blocks.clear();
+}
+
+KVCache& KVCache::operator=(KVCache&& other) noexcept {
+    if (this != &other) {
+        release_all();
+        pool = std::move(other.pool);
+        max_positions = other.max_positions;
+        length = other.length;
+        blocks = std::move(other.blocks);
+        other.length = 0;
+        other.blocks.clear();
+    }
+    return *this;
+}
+
+void KVCache::release_all() {
+    if (pool) {
+        for (size_t block : blocks) {
+            pool->release(block);
+        }
+    }
+    blocks.clear();
+    length = 0;
+}
+
+void KVCache::resize(size_t positions) {
+    if (positions > max_positions) {
+        throw std::out_of_range(
+            "KV cache holds at most " + std::to_string(max_positions) +
+            " positions, requested " + std::to_string(positions));
+    }
+
+    if (positions > length) {
+        make_writable(length);
+    }
+
+    size_t needed = (positions + block_size() - 1) / block_size();
+    try {
+        while (blocks.size() < needed) {
+            blocks.push_back(pool->allocate());
+        }
+    } catch (...) {
+        // Keep the sequence as it was when the pool runs dry
+        size_t current = (length + block_size() - 1) / block_size();
+        while (blocks.size() > current) {
+            pool->release(blocks.back());
+            blocks.pop_back();
+        }
+        throw;
+    }
+    while (blocks.size() > needed) {
+        pool->release(blocks.back());
+        blocks.pop_back();
+    }
+    length = positions;
+}
+
+KVCache KVCache::fork() const {
+    KVCache copy(pool, max_positions);
+    for (size_t block : blocks) {
+        pool->retain(block);
+    }
+    copy.blocks = blocks;
+    copy.length = length;
+    return copy;
+}
+
+void KVCache::make_writable(size_t pos) {
+    for (size_t index = pos / block_size(); index < blocks.size(); ++index) {
+        size_t block = blocks[index];
+        if (pool->ref_count(block) > 1) {
+            size_t copy = pool->allocate();
+            pool->copy_block(block, copy);
+            pool->release(block);
+            blocks[index] = copy;
+        }
+    }
+}
@@ -1,7 +1,11 @@
 #include "multihead_self_attention.hpp"
+#include "thread_pool.hpp"
 #include <xtensor/xview.hpp>
 #include <xtensor/xadapt.hpp>
 #include <xtensor-blas/xlinalg.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <stdexcept>
 
 
@@ -113,4 +117,120 @@ xt::xarray<float> MultiHeadAttention::forward(
     xt::xarray<float> output = xt::linalg::dot(combined_attention, projection_weights) + projection_biases;
     
     return output;
-}
\ No newline at end of file
+}
+
+namespace {
+
+// Arguments of one forward_cached call, shared by all of its (token, head) tasks
+struct CachedAttentionArgs {
+    const float* qkv;
+    const KVCache* cache;
+    size_t layer;
+    size_t base_pos;
+    size_t n_tokens;
+    size_t num_heads;
+    size_t d_model;
+    size_t head_dim;
+    float* output;
+};
+
+// One task per (token, head), the scores of a task are a single row so nothing
+// of size [seq_len, seq_len] is ever materialized and no mask is needed.
+// The cached rows are gathered block by block following the cache's block table.
+// HEAD_DIM = 0 takes the head size from args at runtime, a fixed HEAD_DIM lets the
+// compiler fully unroll and vectorize the per-head dot products.
+template <size_t HEAD_DIM>
+void attend_cached(const CachedAttentionArgs& args, size_t first, size_t last) {
+    const size_t head_dim = HEAD_DIM != 0 ? HEAD_DIM : args.head_dim;
+    const size_t d_model = args.d_model;
+    const size_t row = 3 * d_model;
+    const size_t block_size = args.cache->block_size();
+    const float scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+
+    std::vector<float> scores(args.base_pos + args.n_tokens);
+
+    for (size_t task = first; task < last; ++task) {
+        size_t i = task / args.num_heads;
+        size_t h = task % args.num_heads;
+        size_t context = args.base_pos + i + 1;
+        const float* q = args.qkv + i * row + h * head_dim;
+
+        float max_score = -std::numeric_limits<float>::infinity();
+        for (size_t start = 0; start < context; start += block_size) {
+            const float* keys = args.cache->key_block(args.layer, start / block_size) + h * head_dim;
+            size_t rows = std::min(block_size, context - start);
+            for (size_t r = 0; r < rows; ++r) {
+                const float* k = keys + r * d_model;
+                float dot = 0.0f;
+                for (size_t d = 0; d < head_dim; ++d) {
+                    dot += q[d] * k[d];
+                }
+                scores[start + r] = dot * scale;
+                max_score = std::max(max_score, scores[start + r]);
+            }
+        }
+
+        float sum = 0.0f;
+        for (size_t j = 0; j < context; ++j) {
+            scores[j] = std::exp(scores[j] - max_score);
+            sum += scores[j];
+        }
+
+        float* out = args.output + i * d_model + h * head_dim;
+        std::fill(out, out + head_dim, 0.0f);
+        for (size_t start = 0; start < context; start += block_size) {
+            const float* values = args.cache->value_block(args.layer, start / block_size) + h * head_dim;
+            size_t rows = std::min(block_size, context - start);
+            for (size_t r = 0; r < rows; ++r) {
+                const float* v = values + r * d_model;
+                float weight = scores[start + r] / sum;
+                for (size_t d = 0; d < head_dim; ++d) {
+                    out[d] += weight * v[d];
+                }
+            }
+        }
+    }
+}
+
+} // namespace
+
+void MultiHeadAttention::forward_cached(
+    const float* qkv,
+    size_t n_tokens,
+    KVCache& cache,
+    size_t layer,
+    size_t base_pos,
+    float* output,
+    ThreadPool* pool
+) const {
+    if (base_pos + n_tokens > cache.size()) {
+        throw std::out_of_range("forward_cached writes past the end of the KV cache");
+    }
+
+    size_t head_dim = d_model / num_heads;
+    size_t row = 3 * d_model;
+
+    // Append the keys and values of the new tokens, Q stays in the projection buffer
+    for (size_t i = 0; i < n_tokens; ++i) {
+        const float* src = qkv + i * row;
+        std::copy(src + d_model, src + 2 * d_model, cache.key(layer, base_pos + i));
+        std::copy(src + 2 * d_model, src + 3 * d_model, cache.value(layer, base_pos + i));
+    }
+
+    CachedAttentionArgs args{qkv, &cache, layer, base_pos, n_tokens, num_heads, d_model, head_dim, output};
+
+    // Every released GPT-2 checkpoint uses 64 wide heads
+    auto attend = [&args, head_dim](size_t first, size_t last) {
+        if (head_dim == 64) {
+            attend_cached<64>(args, first, last);
+        } else {
+            attend_cached<0>(args, first, last);
+        }
+    };
+
+    if (pool != nullptr) {
+        pool->parallel_for(n_tokens * num_heads, attend);
+    } else {
+        attend(0, n_tokens * num_heads);
+    }
+}
@@ -2,6 +2,7 @@
 #pragma once
 #include <xtensor/xarray.hpp>
 #include <xtensor/xview.hpp>
+#include "tensor_memory.hpp"
 
 class InputEmbedding {
 public:
@@ -10,7 +11,17 @@ public:
     
     xt::xarray<float> forward(const xt::xarray<int>& input_tokens);
 
+    // Embeds n tokens placed at positions start_pos .. start_pos + n - 1 into out [n, embed_dim],
+    // used by the decode path where the earlier positions already sit in the KV cache
+    // Throws std::out_of_range for token ids outside the vocabulary and positions past max_positions
+    void forward(const int* tokens, std::size_t n, std::size_t start_pos, float* out) const;
+
 private:
-    xt::xarray<float> token_embeddings;
-    xt::xarray<float> positional_embeddings;
+    using Table = tensor_memory::Vector<float, tensor_memory::Category::Weights>;
+
+    std::size_t vocab_size;
+    std::size_t max_positions;
+    std::size_t embed_dim;
+    Table token_embeddings;       // [vocab_size, embed_dim]
+    Table positional_embeddings;  // [max_positions, embed_dim]
 };
\ No newline at end of file
@@ -20,12 +20,18 @@ The forward function of the input embedding layer is implemented below.
 #include <xtensor/xbuilder.hpp>
 #include <xtensor/xview.hpp>
 #include <xtensor/xadapt.hpp>
+#include <stdexcept>
+#include <string>
 
 
 // Constructor takes the token embedding table and positional embedding table
 InputEmbedding::InputEmbedding(const xt::xarray<float>& token_embed_table,
                                const xt::xarray<float>& pos_embed_table)
-    : token_embeddings(token_embed_table), positional_embeddings(pos_embed_table) {
+    : vocab_size(token_embed_table.shape()[0]),
+      max_positions(pos_embed_table.shape()[0]),
+      embed_dim(token_embed_table.shape()[1]),
+      token_embeddings(token_embed_table.begin(), token_embed_table.end()),
+      positional_embeddings(pos_embed_table.begin(), pos_embed_table.end()) {
 
     }
 
@@ -33,29 +39,38 @@ xt::xarray<float> InputEmbedding::forward(const xt::xarray<int>& input_tokens) {
 
     std::size_t batch_size = 1; // Batch size is probably 1 for inference
     std::size_t seq_length = input_tokens.shape()[0];
-    std::size_t embed_dim = token_embeddings.shape()[1];
 
     // The output tensor, shape: (batch_size, seq_length, embed_dim)
     xt::xarray<float> output = xt::zeros<float>({batch_size, seq_length, embed_dim});
 
+    // Token embeddings plus positional embeddings, one sequence starting at position 0
     for (std::size_t b = 0; b < batch_size; b ++){
+        forward(input_tokens.data(), seq_length, 0, output.data() + b * seq_length * embed_dim);
+    }
 
-        // Itereate over the input tokens
-        for(std::size_t i = 0; i < seq_length; i++) {
-
-            // Get the token indices
-            auto token_idx = input_tokens(i);
+    return output;
+}
 
-            // Get the token embeddings and positional embeddings
-            auto token_embed = xt::view(token_embeddings, token_idx, xt::all());
-            auto pos_embed = xt::view(positional_embeddings, i, xt::all());
+void InputEmbedding::forward(const int* tokens, std::size_t n, std::size_t start_pos, float* out) const {
+    const float* token_table = token_embeddings.data();
+    const float* pos_table = positional_embeddings.data();
 
-            // Concate the token embeddings and positional embeddings
-            xt::view(output, b, i, xt::all()) = token_embed + pos_embed;
+    // The positional table ends at max_positions, longer sequences need a context window policy
+    if (start_pos > max_positions || n > max_positions - start_pos) {
+        throw std::out_of_range("Positions " + std::to_string(start_pos) + " to " + std::to_string(start_pos + n) +
+                                " exceed the " + std::to_string(max_positions) + " positions of the embedding table");
+    }
 
+    for (std::size_t i = 0; i < n; i++) {
+        if (tokens[i] < 0 || static_cast<std::size_t>(tokens[i]) >= vocab_size) {
+            throw std::out_of_range("Token id " + std::to_string(tokens[i]) + " is outside the vocabulary");
         }
+        const float* token_embed = token_table + static_cast<std::size_t>(tokens[i]) * embed_dim;
+        const float* pos_embed = pos_table + (start_pos + i) * embed_dim;
+        float* row = out + i * embed_dim;
 
+        for (std::size_t d = 0; d < embed_dim; d++) {
+            row[d] = token_embed[d] + pos_embed[d];
+        }
     }
-
-    return output;
-}
\ No newline at end of file
+}
@@ -19,6 +19,16 @@ public:
         const xt::xarray<float>& gamma,
         const xt::xarray<float>& beta
     );
+
+    // Row wise version used by the decode path, normalizes rows x [rows, dim] into out
+    void forward(
+        const float* x,
+        const float* gamma,
+        const float* beta,
+        size_t rows,
+        size_t dim,
+        float* out
+    ) const;
     
 private:
     float epsilon;
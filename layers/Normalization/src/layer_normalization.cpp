@@ -27,6 +27,7 @@
 
 
 #include "layer_normalization.hpp"
+#include <cmath>
 
 LayerNormalization::LayerNormalization(float eps) 
     : epsilon(eps) {
@@ -59,4 +60,31 @@ xt::xarray<float> LayerNormalization::forward(
     
     // Scale and shift
     return normalized * weight_broadcasted + bias_broadcasted;
-}
\ No newline at end of file
+}
+
+void LayerNormalization::forward(
+    const float* x,
+    const float* gamma,
+    const float* beta,
+    size_t rows,
+    size_t dim,
+    float* out
+) const {
+    for (size_t r = 0; r < rows; ++r) {
+        const float* row = x + r * dim;
+        float* y = out + r * dim;
+
+        float mean = 0.0f;
+        for (size_t i = 0; i < dim; ++i) mean += row[i];
+        mean /= static_cast<float>(dim);
+
+        float variance = 0.0f;
+        for (size_t i = 0; i < dim; ++i) variance += (row[i] - mean) * (row[i] - mean);
+        variance /= static_cast<float>(dim);
+
+        float inv_std = 1.0f / std::sqrt(variance + epsilon);
+        for (size_t i = 0; i < dim; ++i) {
+            y[i] = (row[i] - mean) * inv_std * gamma[i] + beta[i];
+        }
+    }
+}
@@ -0,0 +1,76 @@
+// gemv.hpp
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "tensor_memory.hpp"
+
+class ThreadPool;
+
+// Activation applied to the output of a packed linear layer inside the kernel
+enum class FusedActivation {
+    None,
+    GELU
+};
+
+// Storage format of the packed weights. The 16 bit formats halve the memory and the
+// bandwidth of a weight sweep, the kernels widen them to fp32 in registers and accumulate in fp32.
+enum class WeightPrecision {
+    FP32,
+    BF16,
+    FP16
+};
+
+// Linear layer with its weights re-packed at load time for the decode path.
+//
+// With a KV cache every decode step multiplies a single row (or a handful of rows)
+// by the weight matrix, which is bound by how fast the weights stream from memory.
+// The weights are stored as panels of panel_width output columns, inside a panel the
+// columns of one input feature are contiguous, so the kernel reads every weight exactly
+// once, sequentially, one cache line at a time. Panels are split across the thread pool
+// and the bias add / activation are applied while the accumulators are still in registers.
+class PackedLinear {
+public:
+    // 16 floats = one 64 byte cache line
+    static constexpr size_t panel_width = 16;
+
+    PackedLinear() = default;
+
+    // weights: [in_features, out_features] row major, the Conv1D layout of the GPT-2 checkpoints.
+    // Set transposed for [out_features, in_features] weights such as lm_head.weight.
+    // bias may be nullptr. The fp32 weights are converted to the requested precision while packing,
+    // the bias always stays fp32.
+    PackedLinear(
+        const float* weights,
+        size_t in_features,
+        size_t out_features,
+        const float* bias,
+        FusedActivation activation = FusedActivation::None,
+        bool transposed = false,
+        WeightPrecision precision = WeightPrecision::FP32
+    );
+
+    // output[rows, out_features] = activation(input[rows, in_features] * W + b)
+    void forward(const float* input, size_t rows, float* output, ThreadPool* pool = nullptr) const;
+
+    size_t in_features() const { return in_dim; }
+    size_t out_features() const { return out_dim; }
+    WeightPrecision precision() const { return storage; }
+    size_t weight_bytes() const { return packed.size() * sizeof(float) + packed_half.size() * sizeof(uint16_t); }
+
+private:
+    size_t in_dim{0};
+    size_t out_dim{0};
+    size_t num_panels{0};
+    FusedActivation activation{FusedActivation::None};
+    WeightPrecision storage{WeightPrecision::FP32};
+    template <class T>
+    using WeightVector = tensor_memory::Vector<T, tensor_memory::Category::Weights>;
+
+    WeightVector<float> packed;          // [num_panels, in_dim, panel_width], FP32 storage
+    WeightVector<uint16_t> packed_half;  // Same layout, BF16 / FP16 storage
+    WeightVector<float> bias;            // [num_panels * panel_width], zero padded
+
+    template <class Widen>
+    void run_panels(const float* input, size_t rows, float* output, size_t first, size_t last) const;
+};
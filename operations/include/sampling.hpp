@@ -0,0 +1,24 @@
+// sampling.hpp
+#pragma once
+#include <cstddef>
+#include <random>
+#include <vector>
+
+// Helpers that turn a row of raw logits into token choices
+namespace sampling {
+
+// Indices of the k largest logits, largest first
+std::vector<int> top_k_indices(const float* logits, size_t n, size_t k);
+
+// log(sum(exp(logits))), computed stably
+float log_sum_exp(const float* logits, size_t n);
+
+// Top-k sampling at the given temperature. The softmax over the k largest logits is
+// the same distribution as renormalizing their probabilities.
+int sample_top_k(const float* logits, size_t n, int k, float temperature, std::mt19937& rng);
+
+// Probabilities of the top-k / temperature distribution over the whole vocabulary,
+// zero outside the k most likely tokens
+std::vector<float> top_k_distribution(const float* logits, size_t n, int k, float temperature);
+
+} // namespace sampling
@@ -0,0 +1,74 @@
+// shortlist_head.hpp
+#pragma once
+#include "gemv.hpp"
+#include "tensor_memory.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// Approximate output projection that only computes the logits of a per-step shortlist.
+//
+// At load time the vocabulary rows of lm_head are grouped with k-means into num_clusters
+// clusters and stored cluster by cluster. A step scores the hidden state against the
+// centroids, takes the probes best clusters and computes exact logits for their members
+// only, every other token gets -inf. Sampling only needs the top-k candidates, which
+// with enough probes are almost always inside the shortlist.
+// Cost per row is num_clusters + shortlist dot products instead of vocab_size.
+// The clustered rows are a second copy of lm_head, kept in the precision lm_head is
+// stored in (vocab_size * d_model * 4 or 2 bytes) plus the fp32 centroids.
+class ShortlistHead {
+public:
+    ShortlistHead() = default;
+
+    // weights: [vocab_size, d_model], the layout of lm_head.weight. The clustering runs on
+    // the fp32 weights, the rows are stored converted to precision and widened per dot product.
+    ShortlistHead(
+        const float* weights,
+        size_t vocab_size,
+        size_t d_model,
+        size_t num_clusters,
+        size_t probes,
+        ThreadPool* pool = nullptr,
+        size_t iterations = 6,
+        uint32_t seed = 0,
+        WeightPrecision precision = WeightPrecision::FP32
+    );
+
+    // logits[rows, vocab_size], exact for the shortlisted tokens and -inf for the rest
+    void forward(const float* input, size_t rows, float* logits, ThreadPool* pool = nullptr) const;
+
+    // Token ids of the shortlist of one hidden state, with their exact logits
+    void shortlist(const float* input, std::vector<int>& ids, std::vector<float>& logits,
+                   ThreadPool* pool = nullptr) const;
+
+    void set_probes(size_t probes);
+    size_t probes() const { return num_probes; }
+    size_t num_clusters() const { return cluster_start.empty() ? 0 : cluster_start.size() - 1; }
+    size_t vocab_size() const { return vocab; }
+    size_t cluster_size(size_t cluster) const { return cluster_start[cluster + 1] - cluster_start[cluster]; }
+    WeightPrecision precision() const { return storage; }
+    size_t weight_bytes() const {
+        return (centroids.size() + cluster_rows.size()) * sizeof(float) + cluster_rows_half.size() * sizeof(uint16_t);
+    }
+
+private:
+    template <class T>
+    using Weights = tensor_memory::Vector<T, tensor_memory::Category::Weights>;
+
+    size_t vocab{0};
+    size_t d_model{0};
+    size_t num_probes{0};
+    WeightPrecision storage{WeightPrecision::FP32};
+    Weights<float> centroids;              // [num_clusters, d_model]
+    Weights<float> cluster_rows;           // [vocab_size, d_model], grouped by cluster, FP32 storage
+    Weights<uint16_t> cluster_rows_half;   // Same layout, BF16 / FP16 storage
+    std::vector<int> row_token;            // Token id of every clustered row
+    std::vector<size_t> cluster_start;     // Rows of cluster c are [cluster_start[c], cluster_start[c + 1])
+
+    // Indices of the probes clusters whose centroids score highest against input
+    std::vector<size_t> probe_clusters(const float* input) const;
+    // Logit of clustered row i for the hidden state input
+    float row_logit(const float* input, size_t i) const;
+};
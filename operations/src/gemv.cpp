@@ -0,0 +1,212 @@
+/*
+
+Packed GEMV
+-----------
+
+Decode kernel for the linear layers (c_attn, c_proj, c_fc and lm_head).
+
+    - The weights are copied once at load time into panels of 16 output columns
+    - Panel p holds W[k, 16p .. 16p + 15] for every input feature k, one cache line per k
+    - For every panel the kernel keeps 16 accumulators per input row in registers,
+      streams the panel from memory once and adds the bias / applies GELU before storing
+    - Up to 4 input rows share one pass over the panel, so chunked prefill and batched
+      decode reuse every weight cache line for several tokens
+    - Panels are independent, so the output columns are split across the thread pool
+    - BF16 / FP16 panels are widened to fp32 one cache line pair at a time right before
+      the multiply, the accumulation is always fp32
+
+*/
+
+#include "gemv.hpp"
+#include "half.hpp"
+#if defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <type_traits>
+
+namespace {
+
+constexpr size_t W = PackedLinear::panel_width;
+constexpr size_t max_block_rows = 4;
+
+// Same tanh approximation as activation::GELU
+inline float gelu(float x) {
+    return 0.5f * x * (1.0f + std::tanh(0.797884f * (x + 0.044715f * x * x * x)));
+}
+
+// Widening policies, turn panel_width stored weights into fp32 values
+struct FP32Weights {
+    using Storage = float;
+    static const float* widen(const float* w, float*) { return w; }
+};
+
+struct BF16Weights {
+    using Storage = uint16_t;
+    static const float* widen(const uint16_t* w, float* buffer) {
+#if defined(__AVX2__)
+        for (size_t j = 0; j < W; j += 8) {
+            __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + j)));
+            _mm256_storeu_ps(buffer + j, _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16)));
+        }
+#else
+        for (size_t j = 0; j < W; ++j) {
+            buffer[j] = half::bf16_to_float(w[j]);
+        }
+#endif
+        return buffer;
+    }
+};
+
+struct FP16Weights {
+    using Storage = uint16_t;
+    static const float* widen(const uint16_t* w, float* buffer) {
+#if defined(__F16C__)
+        _mm256_storeu_ps(buffer, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w))));
+        _mm256_storeu_ps(buffer + 8, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + 8))));
+#else
+        for (size_t j = 0; j < W; ++j) {
+            buffer[j] = half::fp16_to_float(w[j]);
+        }
+#endif
+        return buffer;
+    }
+};
+
+// Computes one panel for ROWS input rows
+template <size_t ROWS, class Weights>
+inline void panel_kernel(
+    const float* input,
+    size_t in_dim,
+    const typename Weights::Storage* panel,
+    const float* bias,
+    float (&acc)[max_block_rows][W]
+) {
+    alignas(64) float buffer[W];
+
+    for (size_t r = 0; r < ROWS; ++r) {
+        for (size_t j = 0; j < W; ++j) {
+            acc[r][j] = bias[j];
+        }
+    }
+
+    for (size_t k = 0; k < in_dim; ++k) {
+        const float* w = Weights::widen(panel + k * W, buffer);
+        for (size_t r = 0; r < ROWS; ++r) {
+            const float x = input[r * in_dim + k];
+            for (size_t j = 0; j < W; ++j) {
+                acc[r][j] += x * w[j];
+            }
+        }
+    }
+}
+
+} // namespace
+
+PackedLinear::PackedLinear(
+    const float* weights,
+    size_t in_features,
+    size_t out_features,
+    const float* bias_values,
+    FusedActivation fused_activation,
+    bool transposed,
+    WeightPrecision precision
+) : in_dim(in_features), out_dim(out_features), activation(fused_activation), storage(precision) {
+    if (weights == nullptr || in_features == 0 || out_features == 0) {
+        throw std::invalid_argument("PackedLinear needs a non empty weight matrix");
+    }
+
+    num_panels = (out_dim + W - 1) / W;
+    size_t packed_size = num_panels * in_dim * W;
+    if (storage == WeightPrecision::FP32) {
+        packed.assign(packed_size, 0.0f);
+    } else {
+        packed_half.assign(packed_size, 0);
+    }
+    bias.assign(num_panels * W, 0.0f);
+
+    for (size_t p = 0; p < num_panels; ++p) {
+        size_t panel = p * in_dim * W;
+        size_t cols = std::min(W, out_dim - p * W);
+        for (size_t k = 0; k < in_dim; ++k) {
+            for (size_t j = 0; j < cols; ++j) {
+                size_t col = p * W + j;
+                size_t index = panel + k * W + j;
+                float value = transposed ? weights[col * in_dim + k] : weights[k * out_dim + col];
+
+                switch (storage) {
+                    case WeightPrecision::FP32: packed[index] = value; break;
+                    case WeightPrecision::BF16: packed_half[index] = half::float_to_bf16(value); break;
+                    case WeightPrecision::FP16: packed_half[index] = half::float_to_fp16(value); break;
+                }
+            }
+        }
+    }
+
+    if (bias_values != nullptr) {
+        std::copy(bias_values, bias_values + out_dim, bias.begin());
+    }
+}
+
+template <class Weights>
+void PackedLinear::run_panels(const float* input, size_t rows, float* output, size_t first, size_t last) const {
+    using Storage = typename Weights::Storage;
+    float acc[max_block_rows][W];
+
+    const Storage* weights;
+    if constexpr (std::is_same_v<Storage, float>) {
+        weights = packed.data();
+    } else {
+        weights = packed_half.data();
+    }
+
+    for (size_t p = first; p < last; ++p) {
+        const Storage* panel = weights + p * in_dim * W;
+        const float* panel_bias = bias.data() + p * W;
+        size_t cols = std::min(W, out_dim - p * W);
+
+        for (size_t r0 = 0; r0 < rows; r0 += max_block_rows) {
+            size_t block = std::min(max_block_rows, rows - r0);
+            const float* x = input + r0 * in_dim;
+
+            switch (block) {
+                case 4: panel_kernel<4, Weights>(x, in_dim, panel, panel_bias, acc); break;
+                case 3: panel_kernel<3, Weights>(x, in_dim, panel, panel_bias, acc); break;
+                case 2: panel_kernel<2, Weights>(x, in_dim, panel, panel_bias, acc); break;
+                default: panel_kernel<1, Weights>(x, in_dim, panel, panel_bias, acc); break;
+            }
+
+            for (size_t r = 0; r < block; ++r) {
+                float* y = output + (r0 + r) * out_dim + p * W;
+                if (activation == FusedActivation::GELU) {
+                    for (size_t j = 0; j < cols; ++j) y[j] = gelu(acc[r][j]);
+                } else {
+                    for (size_t j = 0; j < cols; ++j) y[j] = acc[r][j];
+                }
+            }
+        }
+    }
+}
+
+void PackedLinear::forward(const float* input, size_t rows, float* output, ThreadPool* pool) const {
+    if (rows == 0) {
+        return;
+    }
+
+    auto run = [&](size_t first, size_t last) {
+        switch (storage) {
+            case WeightPrecision::FP32: run_panels<FP32Weights>(input, rows, output, first, last); break;
+            case WeightPrecision::BF16: run_panels<BF16Weights>(input, rows, output, first, last); break;
+            case WeightPrecision::FP16: run_panels<FP16Weights>(input, rows, output, first, last); break;
+        }
+    };
+
+    if (pool == nullptr) {
+        run(0, num_panels);
+        return;
+    }
+    pool->parallel_for(num_panels, run);
+}
@@ -0,0 +1,78 @@
+#include "sampling.hpp"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace sampling {
+
+std::vector<int> top_k_indices(const float* logits, size_t n, size_t k) {
+    k = std::min(k, n);
+    std::vector<int> indices(n);
+    std::iota(indices.begin(), indices.end(), 0);
+    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(),
+        [logits](int a, int b) { return logits[a] > logits[b]; });
+    indices.resize(k);
+    return indices;
+}
+
+float log_sum_exp(const float* logits, size_t n) {
+    float max_logit = *std::max_element(logits, logits + n);
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += std::exp(static_cast<double>(logits[i] - max_logit));
+    }
+    return max_logit + static_cast<float>(std::log(sum));
+}
+
+int sample_top_k(const float* logits, size_t n, int k, float temperature, std::mt19937& rng) {
+    size_t top = std::min<size_t>(static_cast<size_t>(std::max(k, 1)), n);
+    std::vector<int> indices = top_k_indices(logits, n, top);
+    if (temperature <= 0.0f) {
+        return indices[0];  // Greedy
+    }
+
+    std::vector<float> probs(top);
+    float max_logit = logits[indices[0]];
+    float sum = 0.0f;
+    for (size_t i = 0; i < top; ++i) {
+        probs[i] = std::exp((logits[indices[i]] - max_logit) / temperature);
+        sum += probs[i];
+    }
+
+    std::uniform_real_distribution<float> dis(0.0f, sum);
+    float rand_val = dis(rng);
+    float cumsum = 0.0f;
+    for (size_t i = 0; i < top; ++i) {
+        cumsum += probs[i];
+        if (rand_val <= cumsum) {
+            return indices[i];
+        }
+    }
+
+    // Fallback case: the most probable token
+    return indices[0];
+}
+
+std::vector<float> top_k_distribution(const float* logits, size_t n, int k, float temperature) {
+    size_t top = std::min<size_t>(static_cast<size_t>(std::max(k, 1)), n);
+    std::vector<int> indices = top_k_indices(logits, n, top);
+    std::vector<float> probs(n, 0.0f);
+
+    if (temperature <= 0.0f) {
+        probs[indices[0]] = 1.0f;
+        return probs;
+    }
+
+    float max_logit = logits[indices[0]];
+    float sum = 0.0f;
+    for (int index : indices) {
+        probs[index] = std::exp((logits[index] - max_logit) / temperature);
+        sum += probs[index];
+    }
+    for (int index : indices) {
+        probs[index] /= sum;
+    }
+    return probs;
+}
+
+} // namespace sampling
@@ -0,0 +1,262 @@
+/*
+
+Shortlist head
+--------------
+
+Approximate lm_head for sampling, an inverted file over the vocabulary rows.
+
+    - Load time: k-means (Lloyd iterations) over the [vocab, d_model] rows, seeded with
+      distinct random rows, empty clusters are re-seeded with a random row
+    - The rows are copied cluster by cluster, so one cluster is one contiguous sweep, in the
+      storage precision of lm_head; BF16 / FP16 rows are widened inside the dot product
+    - Step: the hidden state is scored against every centroid (inner product), the probes
+      best clusters form the shortlist and their rows get exact dot products
+    - The probed clusters are split across the thread pool, the centroid scoring is small
+      enough to stay on the calling thread
+
+*/
+
+#include "shortlist_head.hpp"
+#include "half.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+namespace {
+
+// 16 independent accumulators so the loop vectorizes without reassociating the sum
+inline float dot(const float* a, const float* b, size_t n) {
+    constexpr size_t lanes = 16;
+    float acc[lanes] = {};
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (size_t j = 0; j < lanes; ++j) {
+            acc[j] += a[i + j] * b[i + j];
+        }
+    }
+    float sum = 0.0f;
+    for (size_t j = 0; j < lanes; ++j) {
+        sum += acc[j];
+    }
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// Same over a row of 16 bit weights, widened to fp32 by Widen
+template <float (*Widen)(uint16_t)>
+inline float dot(const float* a, const uint16_t* b, size_t n) {
+    constexpr size_t lanes = 16;
+    float acc[lanes] = {};
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (size_t j = 0; j < lanes; ++j) {
+            acc[j] += a[i + j] * Widen(b[i + j]);
+        }
+    }
+    float sum = 0.0f;
+    for (size_t j = 0; j < lanes; ++j) {
+        sum += acc[j];
+    }
+    for (; i < n; ++i) {
+        sum += a[i] * Widen(b[i]);
+    }
+    return sum;
+}
+
+void run(ThreadPool* pool, size_t n, const std::function<void(size_t, size_t)>& fn) {
+    if (pool) {
+        pool->parallel_for(n, fn);
+    } else {
+        fn(0, n);
+    }
+}
+
+} // namespace
+
+ShortlistHead::ShortlistHead(
+    const float* weights,
+    size_t vocab_size,
+    size_t d_model,
+    size_t num_clusters,
+    size_t probes,
+    ThreadPool* pool,
+    size_t iterations,
+    uint32_t seed,
+    WeightPrecision precision
+) : vocab(vocab_size), d_model(d_model), storage(precision) {
+    if (vocab_size == 0 || d_model == 0) {
+        throw std::invalid_argument("ShortlistHead needs a non-empty weight matrix");
+    }
+    if (num_clusters == 0 || num_clusters > vocab_size) {
+        throw std::invalid_argument("ShortlistHead needs between 1 and vocab_size clusters");
+    }
+    size_t C = num_clusters;
+    size_t d = d_model;
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> random_row(0, vocab_size - 1);
+    std::vector<size_t> order(vocab_size);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), rng);
+
+    centroids.assign(C * d, 0.0f);
+    for (size_t c = 0; c < C; ++c) {
+        std::copy_n(weights + order[c] * d, d, centroids.begin() + c * d);
+    }
+
+    // argmin_c |w - c|^2 = argmax_c (w.c - |c|^2 / 2)
+    std::vector<size_t> assignment(vocab_size);
+    std::vector<float> half_norm(C);
+    std::vector<size_t> counts(C);
+    for (size_t it = 0; it < std::max<size_t>(iterations, 1); ++it) {
+        for (size_t c = 0; c < C; ++c) {
+            const float* centroid = centroids.data() + c * d;
+            half_norm[c] = 0.5f * dot(centroid, centroid, d);
+        }
+        run(pool, vocab_size, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; ++v) {
+                const float* w = weights + v * d;
+                float best = -std::numeric_limits<float>::infinity();
+                for (size_t c = 0; c < C; ++c) {
+                    float score = dot(w, centroids.data() + c * d, d) - half_norm[c];
+                    if (score > best) {
+                        best = score;
+                        assignment[v] = c;
+                    }
+                }
+            }
+        });
+
+        // New centroids are the means of their members
+        std::fill(centroids.begin(), centroids.end(), 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t v = 0; v < vocab_size; ++v) {
+            float* centroid = centroids.data() + assignment[v] * d;
+            const float* w = weights + v * d;
+            for (size_t j = 0; j < d; ++j) {
+                centroid[j] += w[j];
+            }
+            counts[assignment[v]]++;
+        }
+        bool last = it + 1 >= iterations;
+        for (size_t c = 0; c < C; ++c) {
+            float* centroid = centroids.data() + c * d;
+            if (counts[c] > 0) {
+                float scale = 1.0f / counts[c];
+                for (size_t j = 0; j < d; ++j) {
+                    centroid[j] *= scale;
+                }
+            } else if (!last) {
+                std::copy_n(weights + random_row(rng) * d, d, centroid);
+            }
+        }
+    }
+
+    // Rows grouped by the final assignment, the centroids are their means
+    cluster_start.assign(C + 1, 0);
+    for (size_t v = 0; v < vocab_size; ++v) {
+        cluster_start[assignment[v] + 1]++;
+    }
+    std::partial_sum(cluster_start.begin(), cluster_start.end(), cluster_start.begin());
+
+    if (storage == WeightPrecision::FP32) {
+        cluster_rows.resize(vocab_size * d);
+    } else {
+        cluster_rows_half.resize(vocab_size * d);
+    }
+    row_token.resize(vocab_size);
+    std::vector<size_t> fill(cluster_start.begin(), cluster_start.end() - 1);
+    for (size_t v = 0; v < vocab_size; ++v) {
+        size_t r = fill[assignment[v]]++;
+        row_token[r] = static_cast<int>(v);
+        const float* w = weights + v * d;
+        switch (storage) {
+            case WeightPrecision::FP32:
+                std::copy_n(w, d, cluster_rows.begin() + r * d);
+                break;
+            case WeightPrecision::BF16:
+                std::transform(w, w + d, cluster_rows_half.begin() + r * d, half::float_to_bf16);
+                break;
+            case WeightPrecision::FP16:
+                std::transform(w, w + d, cluster_rows_half.begin() + r * d, half::float_to_fp16);
+                break;
+        }
+    }
+
+    set_probes(probes);
+}
+
+void ShortlistHead::set_probes(size_t probes) {
+    num_probes = std::min(std::max<size_t>(probes, 1), num_clusters());
+}
+
+std::vector<size_t> ShortlistHead::probe_clusters(const float* input) const {
+    size_t C = num_clusters();
+    std::vector<float> scores(C);
+    for (size_t c = 0; c < C; ++c) {
+        scores[c] = dot(input, centroids.data() + c * d_model, d_model);
+    }
+    std::vector<size_t> best(C);
+    std::iota(best.begin(), best.end(), 0);
+    std::partial_sort(best.begin(), best.begin() + num_probes, best.end(),
+                      [&scores](size_t a, size_t b) { return scores[a] > scores[b]; });
+    best.resize(num_probes);
+    return best;
+}
+
+float ShortlistHead::row_logit(const float* input, size_t i) const {
+    switch (storage) {
+        case WeightPrecision::BF16: return dot<half::bf16_to_float>(input, cluster_rows_half.data() + i * d_model, d_model);
+        case WeightPrecision::FP16: return dot<half::fp16_to_float>(input, cluster_rows_half.data() + i * d_model, d_model);
+        case WeightPrecision::FP32: break;
+    }
+    return dot(input, cluster_rows.data() + i * d_model, d_model);
+}
+
+void ShortlistHead::forward(const float* input, size_t rows, float* logits, ThreadPool* pool) const {
+    for (size_t r = 0; r < rows; ++r) {
+        const float* h = input + r * d_model;
+        float* out = logits + r * vocab;
+        std::fill(out, out + vocab, -std::numeric_limits<float>::infinity());
+
+        std::vector<size_t> probed = probe_clusters(h);
+        run(pool, probed.size(), [&](size_t begin, size_t end) {
+            for (size_t p = begin; p < end; ++p) {
+                size_t c = probed[p];
+                for (size_t i = cluster_start[c]; i < cluster_start[c + 1]; ++i) {
+                    out[row_token[i]] = row_logit(h, i);
+                }
+            }
+        });
+    }
+}
+
+void ShortlistHead::shortlist(const float* input, std::vector<int>& ids, std::vector<float>& logits,
+                              ThreadPool* pool) const {
+    std::vector<size_t> probed = probe_clusters(input);
+
+    // Output offset of every probed cluster
+    std::vector<size_t> offset(probed.size() + 1, 0);
+    for (size_t p = 0; p < probed.size(); ++p) {
+        offset[p + 1] = offset[p] + cluster_size(probed[p]);
+    }
+    ids.resize(offset.back());
+    logits.resize(offset.back());
+
+    run(pool, probed.size(), [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; ++p) {
+            size_t c = probed[p];
+            size_t out = offset[p];
+            for (size_t i = cluster_start[c]; i < cluster_start[c + 1]; ++i, ++out) {
+                ids[out] = row_token[i];
+                logits[out] = row_logit(input, i);
+            }
+        }
+    });
+}
@@ -0,0 +1,291 @@
+// batch.cpp
+// Batch inference over a JSONL file:
+//   gpt2_batch <input.jsonl | -> [--output FILE] [--model DIR] [--vocab FILE] [--concurrency N]
+//              [--max-tokens N] [--k N] [--temperature T] [--repeat-cache N]
+//
+// One request per input line, every field but prompt is optional and falls back to the
+// command line defaults:
+//   {"id": "a1", "prompt": "...", "max_new_tokens": 64, "k": 40, "temperature": 0.8, "timeout_ms": 5000}
+// One line per request is written as soon as it completes, so the output is in completion
+// order and carries the id (the input line number when the request has none):
+//   {"id": "a1", "text": "...", "tokens": 64, "status": "completed", "ttft_ms": 21.4}
+// Lines that cannot be parsed or fail produce {"id": ..., "error": "..."}.
+//
+// At most concurrency requests are read ahead and in flight, they share the batched
+// decode steps of one AsyncGenerator. Latencies go into fixed log-spaced histograms,
+// so memory does not grow with the input. The summary is printed to stderr.
+// --repeat-cache N keeps the next-token distributions of the last N prompts, so repeated
+// prompts skip their prefill, and adds its hit / miss counters to the summary. Its entries
+// hold KV blocks, at most a quarter of the pool, and give them up when requests need them.
+#include "async_generator.hpp"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double milliseconds(Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+// Latencies from 10 us to ~100 s in buckets 5% apart, percentiles are reported as the
+// upper edge of their bucket
+class LatencyHistogram {
+public:
+    void add(double ms) {
+        size_t bucket = 0;
+        if (ms > min_ms) {
+            bucket = std::min(buckets.size() - 1, static_cast<size_t>(std::ceil(std::log(ms / min_ms) / log_ratio)));
+        }
+        buckets[bucket]++;
+        count++;
+    }
+
+    double percentile(double p) const {
+        if (count == 0) {
+            return 0.0;
+        }
+        size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * count));
+        size_t seen = 0;
+        for (size_t b = 0; b < buckets.size(); ++b) {
+            seen += buckets[b];
+            if (seen >= std::max<size_t>(rank, 1)) {
+                return min_ms * std::exp(b * log_ratio);
+            }
+        }
+        return min_ms * std::exp((buckets.size() - 1) * log_ratio);
+    }
+
+    size_t samples() const { return count; }
+
+private:
+    static constexpr double min_ms = 0.01;
+    const double log_ratio = std::log(1.05);
+    std::vector<size_t> buckets = std::vector<size_t>(330, 0);
+    size_t count = 0;
+};
+
+struct Defaults {
+    size_t max_new_tokens = 64;
+    int k = 40;
+    float temperature = 1.0f;
+};
+
+// A request between submission and its output line, built with the handle submit returned
+struct InFlight {
+    nlohmann::json id;
+    GenerationHandle handle;
+    Clock::time_point submitted;
+    Clock::time_point last_token;
+    size_t tokens = 0;
+    double ttft_ms = 0.0;
+};
+
+const char* status_name(GenerationStatus status) {
+    switch (status) {
+        case GenerationStatus::Completed: return "completed";
+        case GenerationStatus::Cancelled: return "cancelled";
+        case GenerationStatus::DeadlineExceeded: return "deadline_exceeded";
+    }
+    return "unknown";
+}
+
+GenerationRequest parse_request(const nlohmann::json& line, const Defaults& defaults) {
+    GenerationRequest request;
+    request.prompt = line.at("prompt").get<std::string>();
+    request.max_new_tokens = line.value("max_new_tokens", defaults.max_new_tokens);
+    request.k = line.value("k", defaults.k);
+    request.temperature = line.value("temperature", defaults.temperature);
+    if (line.contains("timeout_ms")) {
+        request.deadline = Clock::now() + std::chrono::milliseconds(line.at("timeout_ms").get<long long>());
+    }
+    if (request.k <= 0) {
+        throw std::invalid_argument("k must be positive");
+    }
+    return request;
+}
+
+void write_line(std::ostream& out, const nlohmann::json& record) {
+    out << record.dump() << '\n';
+    out.flush();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string input_path;
+    std::string output_path = "-";
+    std::string model_path = "../parameters/gpt2";
+    std::string vocab_path = "../utils/vocab/gpt2_vocabulary.json";
+    size_t concurrency = 16;
+    size_t repeat_cache = 0;
+    Defaults defaults;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--output" && has_value) {
+            output_path = argv[++i];
+        } else if (arg == "--model" && has_value) {
+            model_path = argv[++i];
+        } else if (arg == "--vocab" && has_value) {
+            vocab_path = argv[++i];
+        } else if (arg == "--concurrency" && has_value) {
+            concurrency = std::max<size_t>(std::strtoul(argv[++i], nullptr, 10), 1);
+        } else if (arg == "--max-tokens" && has_value) {
+            defaults.max_new_tokens = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--k" && has_value) {
+            defaults.k = std::atoi(argv[++i]);
+        } else if (arg == "--temperature" && has_value) {
+            defaults.temperature = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--repeat-cache" && has_value) {
+            repeat_cache = std::strtoul(argv[++i], nullptr, 10);
+        } else if (input_path.empty() && (arg == "-" || arg.rfind("--", 0) != 0)) {
+            input_path = arg;
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (input_path.empty()) {
+        std::cerr << "Usage: " << argv[0] << " <input.jsonl | -> [--output FILE] [--model DIR] [--vocab FILE]"
+                  << " [--concurrency N] [--max-tokens N] [--k N] [--temperature T] [--repeat-cache N]" << std::endl;
+        return 1;
+    }
+
+    try {
+        std::ifstream input_file;
+        if (input_path != "-") {
+            input_file.open(input_path);
+            if (!input_file) {
+                throw std::runtime_error("Cannot open " + input_path);
+            }
+        }
+        std::istream& input = input_path == "-" ? std::cin : input_file;
+
+        std::ofstream output_file;
+        if (output_path != "-") {
+            output_file.open(output_path);
+            if (!output_file) {
+                throw std::runtime_error("Cannot write " + output_path);
+            }
+        }
+        std::ostream& output = output_path == "-" ? std::cout : output_file;
+
+        GPT2 model(model_path, vocab_path);
+        if (repeat_cache > 0) {
+            model.enable_distribution_cache(repeat_cache);
+        }
+        AsyncGenerator generator(model, concurrency);
+
+        LatencyHistogram ttft, inter_token;
+        size_t prompts = 0, failed = 0, total_tokens = 0, line_number = 0;
+        std::vector<InFlight> running;
+        bool input_done = false;
+        Clock::time_point start = Clock::now();
+
+        while (!input_done || !running.empty()) {
+            // Read ahead only while there is a free slot
+            while (!input_done && running.size() < concurrency) {
+                std::string line;
+                if (!std::getline(input, line)) {
+                    input_done = true;
+                    break;
+                }
+                line_number++;
+                if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                    continue;
+                }
+
+                nlohmann::json id = line_number;
+                try {
+                    nlohmann::json request = nlohmann::json::parse(line);
+                    if (request.contains("id")) {
+                        id = request["id"];
+                    }
+                    GenerationRequest parsed = parse_request(request, defaults);
+                    Clock::time_point submitted = Clock::now();
+                    running.push_back(InFlight{id, generator.submit(std::move(parsed)), submitted});
+                } catch (const std::exception& e) {
+                    write_line(output, {{"id", id}, {"error", e.what()}});
+                    failed++;
+                }
+            }
+
+            // Collect the tokens streamed since the last pass, write finished requests
+            bool progress = false;
+            std::vector<InFlight> still_running;
+            for (InFlight& entry : running) {
+                // Checked first, every token of a finished request is already queued
+                bool done = entry.handle.finished();
+                std::string piece;
+                while (entry.handle.try_next_token(piece)) {
+                    Clock::time_point now = Clock::now();
+                    if (entry.tokens == 0) {
+                        entry.ttft_ms = milliseconds(now - entry.submitted);
+                        ttft.add(entry.ttft_ms);
+                    } else {
+                        inter_token.add(milliseconds(now - entry.last_token));
+                    }
+                    entry.last_token = now;
+                    entry.tokens++;
+                    progress = true;
+                }
+
+                if (!done) {
+                    still_running.push_back(std::move(entry));
+                    continue;
+                }
+                progress = true;
+                try {
+                    GenerationResult result = entry.handle.result().get();
+                    write_line(output, {{"id", entry.id}, {"text", result.text}, {"tokens", result.tokens},
+                                        {"status", status_name(result.status)}, {"ttft_ms", entry.ttft_ms}});
+                    total_tokens += result.tokens;
+                    prompts++;
+                } catch (const std::exception& e) {
+                    write_line(output, {{"id", entry.id}, {"error", e.what()}});
+                    failed++;
+                }
+            }
+            running = std::move(still_running);
+
+            if (!progress) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        }
+
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::cerr << std::fixed << std::setprecision(2)
+                  << "Requests: " << prompts << " completed, " << failed << " failed in " << seconds << " s\n"
+                  << "Prompts/sec: " << prompts / seconds << "\n"
+                  << "Tokens/sec: " << total_tokens / seconds << " (" << total_tokens << " tokens)\n";
+        for (const auto& entry : {std::make_pair("Time to first token", &ttft),
+                                  std::make_pair("Inter-token latency", &inter_token)}) {
+            const LatencyHistogram& histogram = *entry.second;
+            std::cerr << entry.first << " ms: p50 " << histogram.percentile(50) << ", p90 " << histogram.percentile(90)
+                      << ", p99 " << histogram.percentile(99) << " (" << histogram.samples() << " samples)\n";
+        }
+        if (repeat_cache > 0) {
+            DistributionCache::Stats cache = model.distribution_cache_stats();
+            std::cerr << "Repeat cache: " << cache.hits << " hits, " << cache.prefix_hits << " prefix hits, "
+                      << cache.misses << " misses, " << cache.evictions << " evictions, "
+                      << cache.blocks << " KV blocks held\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,206 @@
+// head_benchmark.cpp
+// Recall and speed of the shortlist head against the exact lm_head:
+//   gpt2_head_bench <text file> [--model DIR] [--vocab FILE] [--rows N]
+//                   [--clusters N[,N...]] [--probes N[,N...]] [--precision fp32|bf16|fp16]
+//
+// Both heads store lm_head in the given precision, the memory the shortlist adds on top
+// of the exact head is printed with every clusters setting.
+// The hidden states are the real lm_head inputs of the text (last layer after ln_f).
+// For every clusters / probes pair it reports, averaged over the rows:
+//   top1      the approximate argmax is the exact argmax
+//   r@10 r@40 share of the exact top-10 / top-40 tokens inside the shortlist, the
+//             shortlist logits are exact so these also end up in the approximate top-k
+//   mass      exact softmax probability covered by the shortlist
+//   size      shortlist length, us/row the time of one row against the exact head
+#include "GPT2.hpp"
+#include "Loader.hpp"
+#include "gemv.hpp"
+#include "sampling.hpp"
+#include "shortlist_head.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::vector<size_t> parse_list(const std::string& text) {
+    std::vector<size_t> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        values.push_back(std::strtoul(item.c_str(), nullptr, 10));
+    }
+    return values;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string text_path;
+    std::string model_path = "../parameters/gpt2";
+    std::string vocab_path = "../utils/vocab/gpt2_vocabulary.json";
+    size_t max_rows = 512;
+    std::vector<size_t> cluster_counts = {128, 256, 512};
+    std::vector<size_t> probe_counts = {4, 8, 16, 32};
+    WeightPrecision precision = WeightPrecision::FP32;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--model" && has_value) {
+            model_path = argv[++i];
+        } else if (arg == "--vocab" && has_value) {
+            vocab_path = argv[++i];
+        } else if (arg == "--rows" && has_value) {
+            max_rows = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--clusters" && has_value) {
+            cluster_counts = parse_list(argv[++i]);
+        } else if (arg == "--probes" && has_value) {
+            probe_counts = parse_list(argv[++i]);
+        } else if (arg == "--precision" && has_value) {
+            std::string name = argv[++i];
+            if (name == "fp32") {
+                precision = WeightPrecision::FP32;
+            } else if (name == "bf16") {
+                precision = WeightPrecision::BF16;
+            } else if (name == "fp16") {
+                precision = WeightPrecision::FP16;
+            } else {
+                std::cerr << "Unknown precision: " << name << std::endl;
+                return 1;
+            }
+        } else if (text_path.empty() && arg.rfind("--", 0) != 0) {
+            text_path = arg;
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (text_path.empty()) {
+        std::cerr << "Usage: " << argv[0] << " <text file> [--model DIR] [--vocab FILE] [--rows N]"
+                  << " [--clusters N[,N...]] [--probes N[,N...]] [--precision fp32|bf16|fp16]" << std::endl;
+        return 1;
+    }
+
+    try {
+        std::ifstream file(text_path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Cannot open " + text_path);
+        }
+        std::stringstream text;
+        text << file.rdbuf();
+
+        GPT2 model(model_path, vocab_path);
+        const GPT2::Config& config = model.model_config();
+        size_t d = config.d_model;
+        size_t vocab = config.vocab_size;
+
+        // Hidden states of the first max_rows tokens, one document per context window
+        std::vector<int> tokens = model.tokenize(text.str());
+        tokens.resize(std::min(tokens.size(), max_rows));
+        if (tokens.empty()) {
+            throw std::runtime_error(text_path + " contains no tokens");
+        }
+        std::vector<std::vector<int>> documents;
+        for (size_t start = 0; start < tokens.size(); start += config.max_positions) {
+            size_t end = std::min(tokens.size(), start + config.max_positions);
+            documents.emplace_back(tokens.begin() + start, tokens.begin() + end);
+        }
+        GPT2::FeatureOptions options;
+        options.pooling = GPT2::Pooling::PerToken;
+        size_t rows = model.feature_rows(documents, options);
+        std::vector<float> hidden(rows * d);
+        model.extract_features(documents, options, hidden.data());
+
+        GPT2WeightLoader loader(config.num_layers);
+        auto weights = loader.loadWeights(model_path, {"lm_head.weight"});
+        const float* lm_head = weights.at("lm_head.weight").data();
+        ThreadPool pool;
+
+        // Reference: the exact head, one row at a time as in decoding
+        PackedLinear exact(lm_head, d, vocab, nullptr, FusedActivation::None, true, precision);
+        std::vector<float> exact_logits(rows * vocab);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < rows; ++r) {
+            exact.forward(hidden.data() + r * d, 1, exact_logits.data() + r * vocab, &pool);
+        }
+        double exact_us = seconds_since(start) * 1e6 / rows;
+
+        std::vector<std::vector<int>> exact_top(rows);
+        std::vector<float> log_norm(rows);
+        for (size_t r = 0; r < rows; ++r) {
+            exact_top[r] = sampling::top_k_indices(exact_logits.data() + r * vocab, vocab, 40);
+            log_norm[r] = sampling::log_sum_exp(exact_logits.data() + r * vocab, vocab);
+        }
+
+        std::cout << rows << " rows, exact head " << std::fixed << std::setprecision(1) << exact_us << " us/row"
+                  << std::endl;
+        std::cout << "clusters probes    top1    r@10    r@40    mass    size   us/row  speed-up" << std::endl;
+
+        std::vector<int> ids;
+        std::vector<float> logits;
+        std::vector<char> listed(vocab);
+        for (size_t clusters : cluster_counts) {
+            start = std::chrono::steady_clock::now();
+            ShortlistHead head(lm_head, vocab, d, clusters, 1, &pool, 6, 0, precision);
+            std::cout << "(" << clusters << " clusters built in " << std::setprecision(2) << seconds_since(start)
+                      << " s, " << std::setprecision(1) << head.weight_bytes() / (1024.0 * 1024.0)
+                      << " MB on top of the exact head's " << exact.weight_bytes() / (1024.0 * 1024.0) << " MB)"
+                      << std::endl;
+
+            for (size_t probes : probe_counts) {
+                head.set_probes(probes);
+                double top1 = 0, recall_10 = 0, recall_40 = 0, mass = 0, size = 0, seconds = 0;
+                for (size_t r = 0; r < rows; ++r) {
+                    start = std::chrono::steady_clock::now();
+                    head.shortlist(hidden.data() + r * d, ids, logits, &pool);
+                    seconds += seconds_since(start);
+
+                    const float* row = exact_logits.data() + r * vocab;
+                    for (int id : ids) {
+                        listed[id] = 1;
+                        mass += std::exp(row[id] - log_norm[r]);
+                    }
+                    size_t best = std::max_element(logits.begin(), logits.end()) - logits.begin();
+                    top1 += ids[best] == exact_top[r][0];
+                    for (size_t k = 0; k < exact_top[r].size(); ++k) {
+                        bool hit = listed[exact_top[r][k]];
+                        recall_10 += k < 10 && hit;
+                        recall_40 += hit;
+                    }
+                    size += ids.size();
+                    for (int id : ids) {
+                        listed[id] = 0;
+                    }
+                }
+
+                double us = seconds * 1e6 / rows;
+                std::cout << std::setw(8) << clusters << std::setw(7) << head.probes() << std::setprecision(4)
+                          << std::setw(8) << top1 / rows
+                          << std::setw(8) << recall_10 / (rows * std::min<size_t>(10, vocab))
+                          << std::setw(8) << recall_40 / (rows * std::min<size_t>(40, vocab))
+                          << std::setw(8) << mass / rows
+                          << std::setprecision(0) << std::setw(8) << size / rows
+                          << std::setprecision(1) << std::setw(9) << us
+                          << std::setw(9) << exact_us / us << "x" << std::endl;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,36 +1,109 @@
 // main.cpp
 #include "GPT2.hpp"
+#include "speculative_decoder.hpp"
+#include "tensor_memory.hpp"
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
 #include <xtensor/xsort.hpp>  // For argsort
 
 // Modified main.cpp
-int main() {
+//   --model DIR --vocab FILE            checkpoint directory and vocabulary
+//   --prompt TEXT --max-tokens N --k N  what to generate, top-k sampling
+//   --context-window PINNED STRIDE      generations past the context keep the first PINNED tokens
+//                                       and drop the oldest STRIDE tokens after them at a time
+//   --mem-report                        print the memory held per category after the run
+//   --huge-pages transparent|explicit   back large buffers with 2 MB pages
+//   --speculative BLOCKS TOKENS         also decode with the first BLOCKS blocks drafting TOKENS
+//                                       tokens per round and compare against plain decoding
+int main(int argc, char* argv[]) {
+    std::string model_path = "../parameters/gpt2";
+    std::string vocab_path = "../utils/vocab/gpt2_vocabulary.json";
+    std::string prompt = "Once there is a man named";
+    size_t max_tokens = 15;
+    int k = 5;
+    bool mem_report = false;
+    size_t draft_blocks = 0;
+    size_t draft_tokens = 0;
+    size_t pinned_tokens = 0;
+    size_t context_stride = 0;
+    for (int i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(argv[i], "--model") == 0 && has_value) {
+            model_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--vocab") == 0 && has_value) {
+            vocab_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--prompt") == 0 && has_value) {
+            prompt = argv[++i];
+        } else if (std::strcmp(argv[i], "--max-tokens") == 0 && has_value) {
+            max_tokens = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--k") == 0 && has_value) {
+            k = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--mem-report") == 0) {
+            mem_report = true;
+        } else if (std::strcmp(argv[i], "--context-window") == 0 && i + 2 < argc) {
+            pinned_tokens = std::strtoul(argv[++i], nullptr, 10);
+            context_stride = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--speculative") == 0 && i + 2 < argc) {
+            draft_blocks = std::strtoul(argv[++i], nullptr, 10);
+            draft_tokens = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--huge-pages") == 0 && has_value) {
+            std::string mode = argv[++i];
+            if (mode == "transparent") {
+                tensor_memory::set_huge_pages(tensor_memory::HugePages::Transparent);
+            } else if (mode == "explicit") {
+                tensor_memory::set_huge_pages(tensor_memory::HugePages::Explicit);
+            } else if (mode != "off") {
+                std::cerr << "Unknown huge page mode: " << mode << std::endl;
+                return 1;
+            }
+        } else {
+            std::cerr << "Unknown argument: " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
     try {
-        GPT2 model("../parameters/gpt2", "../utils/vocab/gpt2_vocabulary.json");
-        std::string text = "Once there is a man named";
+        GPT2 model(model_path, vocab_path);
+        if (context_stride > 0) {
+            model.set_context_window(pinned_tokens, context_stride);
+        }
+        std::string text = prompt;
         std::cout << "Initial prompt: " << text << std::endl;
 
-        GPT2Tokenizer tokenizer("../utils/vocab/gpt2_vocabulary.json");
-        
-        const int max_tokens = 15;
-        const int k = 5;  // Top-5 sampling
-        
-        for(int i = 0; i < max_tokens; i++) {
-            // Generate next token probabilities
-            std::string next_token = model.generate_next_token(text, k);
+        // The prompt is run once, each following step only runs the new token against the KV cache
+        size_t generated = 0;
+        auto count_until_newline = [&generated](const std::string& next_token) {
+            generated++;
+            // Optional: Add stopping condition for newline
+            return next_token != "\n";
+        };
+        auto start = std::chrono::steady_clock::now();
+        text += model.generate(text, max_tokens, k, count_until_newline);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-            text += next_token;
+        double tokens_per_sec = generated / elapsed.count();
+        std::cout << "Generated text: " << text << std::endl;
+        std::cout << "Tokens/sec: " << tokens_per_sec << std::endl;
 
-            // std::cout << next_token << std::flush;
-            
-            
-            // Optional: Add stopping condition for newline
-            if(next_token == "\n") {
-                break;
-            }
+        if (draft_blocks > 0) {
+            SelfSpeculativeDecoder speculative(model, draft_blocks, draft_tokens);
+            generated = 0;
+            std::string speculative_text = prompt + speculative.generate(prompt, max_tokens, k, 1.0f, count_until_newline);
+
+            const SelfSpeculativeDecoder::Stats& stats = speculative.statistics();
+            double speculative_tokens_per_sec = stats.generated / stats.seconds;
+            std::cout << "Speculative text: " << speculative_text << std::endl;
+            std::cout << "Acceptance rate: " << stats.acceptance_rate() << std::endl;
+            std::cout << "Tokens per full pass: " << stats.tokens_per_target_pass() << std::endl;
+            std::cout << "Speculative tokens/sec: " << speculative_tokens_per_sec
+                      << " (speed-up " << speculative_tokens_per_sec / tokens_per_sec << "x)" << std::endl;
+        }
+
+        if (mem_report) {
+            tensor_memory::print_report(std::cout);
         }
-        
-        std::cout << "Generated text: " << text << std::endl;
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
@@ -0,0 +1,160 @@
+// pipeline_benchmark.cpp
+// Throughput of the layer-pipelined prefill against sequential GPT2::prefill:
+//   gpt2_pipeline_bench <text file> [--model DIR] [--vocab FILE] [--prompts N] [--prompt-tokens N]
+//                       [--stages N] [--threads-per-stage N] [--micro-batch N] [--queue-depth N] [--no-pin]
+//
+// The text is cut into prompts of prompt-tokens tokens (the last one may be shorter and
+// the text is reused from the start when it runs out). Both runs prefill the same prompts
+// into fresh caches and keep the next-token logits of every prompt; the sequential run
+// is one prompt after the other on the model's own pool, as in gpt2_batch's admission.
+// Reports prompts/s, prefill tokens/s, the speed-up and how far the two sets of logits
+// are apart (they differ only by the summation order of the kernels).
+#include "GPT2.hpp"
+#include "pipeline_executor.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string text_path;
+    std::string model_path = "../parameters/gpt2";
+    std::string vocab_path = "../utils/vocab/gpt2_vocabulary.json";
+    size_t num_prompts = 64;
+    size_t prompt_tokens = 128;
+    PipelineExecutor::Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--model" && has_value) {
+            model_path = argv[++i];
+        } else if (arg == "--vocab" && has_value) {
+            vocab_path = argv[++i];
+        } else if (arg == "--prompts" && has_value) {
+            num_prompts = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--prompt-tokens" && has_value) {
+            prompt_tokens = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--stages" && has_value) {
+            options.stages = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--threads-per-stage" && has_value) {
+            options.threads_per_stage = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--micro-batch" && has_value) {
+            options.micro_batch_tokens = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--queue-depth" && has_value) {
+            options.queue_depth = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--no-pin") {
+            options.pin_threads = false;
+        } else if (text_path.empty() && arg.rfind("--", 0) != 0) {
+            text_path = arg;
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (text_path.empty()) {
+        std::cerr << "Usage: " << argv[0] << " <text file> [--model DIR] [--vocab FILE] [--prompts N]"
+                  << " [--prompt-tokens N] [--stages N] [--threads-per-stage N] [--micro-batch N]"
+                  << " [--queue-depth N] [--no-pin]" << std::endl;
+        return 1;
+    }
+
+    try {
+        std::ifstream file(text_path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Cannot open " + text_path);
+        }
+        std::stringstream text;
+        text << file.rdbuf();
+
+        GPT2 model(model_path, vocab_path);
+        model.wait_until_loaded();
+        const GPT2::Config& config = model.model_config();
+        size_t vocab = config.vocab_size;
+        prompt_tokens = std::min(std::max<size_t>(prompt_tokens, 1), config.max_positions);
+
+        std::vector<int> tokens = model.tokenize(text.str());
+        if (tokens.empty() || num_prompts == 0) {
+            throw std::runtime_error("Nothing to prefill, the text has no tokens or --prompts is 0");
+        }
+        std::vector<std::vector<int>> prompts;
+        size_t total_tokens = 0;
+        for (size_t p = 0, offset = 0; p < num_prompts; ++p) {
+            if (offset >= tokens.size()) {
+                offset = 0;
+            }
+            size_t n = std::min(prompt_tokens, tokens.size() - offset);
+            prompts.emplace_back(tokens.begin() + offset, tokens.begin() + offset + n);
+            offset += n;
+            total_tokens += n;
+        }
+
+        // One untimed prompt each, the first pass pays for page faults and thread start-up
+        std::vector<float> sequential(prompts.size() * vocab);
+        {
+            KVCache cache = model.create_cache();
+            model.prefill(prompts[0], cache, sequential.data());
+        }
+        PipelineExecutor executor(model, options);
+        std::vector<float> pipelined(prompts.size() * vocab);
+        executor.run({prompts[0]}, pipelined.data());
+        executor.reset_statistics();
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t p = 0; p < prompts.size(); ++p) {
+            KVCache cache = model.create_cache();
+            model.prefill(prompts[p], cache, sequential.data() + p * vocab);
+        }
+        double sequential_seconds = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        executor.run(prompts, pipelined.data());
+        double pipelined_seconds = seconds_since(start);
+
+        float max_diff = 0.0f;
+        size_t same_argmax = 0;
+        for (size_t p = 0; p < prompts.size(); ++p) {
+            const float* a = sequential.data() + p * vocab;
+            const float* b = pipelined.data() + p * vocab;
+            for (size_t v = 0; v < vocab; ++v) {
+                max_diff = std::max(max_diff, std::abs(a[v] - b[v]));
+            }
+            same_argmax += std::max_element(a, a + vocab) - a == std::max_element(b, b + vocab) - b;
+        }
+
+        std::cout << prompts.size() << " prompts, " << total_tokens << " tokens, " << executor.stages()
+                  << " stages:";
+        for (size_t s = 0; s < executor.stages(); ++s) {
+            auto layers = executor.stage_layers(s);
+            std::cout << " [" << layers.first << ", " << layers.second << ")";
+        }
+        std::cout << ", " << executor.statistics().micro_batches << " micro-batches" << std::endl;
+        std::cout << std::fixed << std::setprecision(1)
+                  << "sequential  " << std::setw(8) << prompts.size() / sequential_seconds << " prompts/s "
+                  << std::setw(10) << total_tokens / sequential_seconds << " tokens/s" << std::endl
+                  << "pipelined   " << std::setw(8) << prompts.size() / pipelined_seconds << " prompts/s "
+                  << std::setw(10) << total_tokens / pipelined_seconds << " tokens/s" << std::endl
+                  << std::setprecision(2) << "speed-up " << sequential_seconds / pipelined_seconds << "x, "
+                  << "max |logit difference| " << std::setprecision(5) << max_diff << ", argmax agrees on "
+                  << same_argmax << " / " << prompts.size() << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+// score.cpp
+// Perplexity of a text file:
+//   gpt2_score <text file> [--model DIR] [--vocab FILE] [--stride N] [--batch N] [--per-token]
+#include "perplexity.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+int main(int argc, char* argv[]) {
+    std::string text_path;
+    std::string model_path = "../parameters/gpt2";
+    std::string vocab_path = "../utils/vocab/gpt2_vocabulary.json";
+    size_t stride = 512;
+    size_t batch = 4;
+    bool per_token = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--model" && has_value) {
+            model_path = argv[++i];
+        } else if (arg == "--vocab" && has_value) {
+            vocab_path = argv[++i];
+        } else if (arg == "--stride" && has_value) {
+            stride = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--batch" && has_value) {
+            batch = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--per-token") {
+            per_token = true;
+        } else if (text_path.empty() && arg.rfind("--", 0) != 0) {
+            text_path = arg;
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (text_path.empty()) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <text file> [--model DIR] [--vocab FILE] [--stride N] [--batch N] [--per-token]" << std::endl;
+        return 1;
+    }
+
+    try {
+        std::ifstream file(text_path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Cannot open " + text_path);
+        }
+
+        GPT2 model(model_path, vocab_path);
+        PerplexityScorer scorer(model, stride, 0, batch);
+        if (per_token) {
+            scorer.on_token([](int token, float log_prob) {
+                std::cout << token << '\t' << log_prob << '\n';
+            });
+        }
+
+        // The file is tokenized a block of lines at a time and scored as it streams in.
+        // Blocks end after a newline, which is where GPT-2's pre-tokenizer splits anyway.
+        const size_t block_bytes = 1 << 20;
+        std::string block, line;
+        while (std::getline(file, line)) {
+            block += line;
+            if (!file.eof()) {
+                block += '\n';
+            }
+            if (block.size() >= block_bytes) {
+                scorer.add_text(block);
+                block.clear();
+            }
+        }
+        if (!block.empty()) {
+            scorer.add_text(block);
+        }
+
+        PerplexityScorer::Report report = scorer.finish();
+        std::cout << "Scored tokens: " << report.scored_tokens << std::endl;
+        std::cout << "Negative log-likelihood: " << -report.log_likelihood << std::endl;
+        std::cout << "Perplexity: " << report.perplexity() << std::endl;
+        std::cout << "Tokens/sec: " << report.tokens_per_second() << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -4,19 +4,48 @@
 #include <unordered_map>
 #include <vector>
 
+class ThreadPool;
+
 class GPT2WeightLoader {
 public:
     using WeightMap = std::unordered_map<std::string, xt::xarray<float>>;
-    
-    GPT2WeightLoader();
-    
-    // Load all weights from the given directory path
+
+    // Dimensions the checkpoint tensors are checked against
+    struct ExpectedShapes {
+        size_t d_model;
+        size_t d_ff;
+        size_t vocab_size;
+        size_t max_positions;
+    };
+
+    // num_layers transformer blocks, 12 for the 124M checkpoint up to 48 for gpt2-xl
+    explicit GPT2WeightLoader(size_t num_layers = 12);
+
+    // Load all weights from the given directory path, the files are read in parallel
     WeightMap loadWeights(const std::string& weight_dir);
-    
+
+    // Loads the named tensors, spread over pool when one is given
+    WeightMap loadWeights(const std::string& weight_dir, const std::vector<std::string>& names,
+                          ThreadPool* pool = nullptr) const;
+
+    // Reads only the .npy headers and checks every tensor against the shapes.
+    // Throws std::runtime_error listing every missing file, wrong dtype or wrong shape.
+    void validateShapes(const std::string& weight_dir, const ExpectedShapes& expected) const;
+
+    // Asks the OS to start reading every file into the page cache, in load order,
+    // so the reads that follow find their data already there (posix_fadvise WILLNEED)
+    void prefetch(const std::string& weight_dir) const;
+
     // Get list of all weight paths for reference
     const std::vector<std::string>& getWeightPaths() const;
 
+    // The same paths grouped the way the model consumes them
+    std::vector<std::string> getEmbeddingWeightPaths() const;
+    std::vector<std::string> getLayerWeightPaths(size_t layer) const;
+    std::vector<std::string> getHeadWeightPaths() const;
+
 private:
+    size_t num_layers;
     std::vector<std::string> weight_paths;
     void initializeWeightPaths();
-};
\ No newline at end of file
+};
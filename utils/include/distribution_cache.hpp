@@ -0,0 +1,75 @@
+#pragma once
+#include "kv_cache.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Next-token distributions of whole prompts, for traffic that repeats the same prompt.
+//
+// An entry is keyed on a hash of the prompt's token ids and holds the top_n largest
+// logits of its last position plus a fork of the prompt's KV cache. The fork shares the
+// KV blocks copy-on-write, so an entry costs no K/V copy, but it keeps its blocks out of
+// the pool until it is evicted. An exact repeat gets the logits and the K/V without
+// running the model, a prompt that extends a cached one gets the K/V of the cached part
+// and only runs the new tokens. At most capacity entries holding at most max_blocks KV
+// blocks are kept, least recently used first out. An entry counts every block its fork
+// covers, shared or not, so the bound errs on the safe side.
+class DistributionCache {
+public:
+    struct Stats {
+        size_t hits;         // Exact repeats
+        size_t prefix_hits;  // Prompts extending a cached prompt
+        size_t misses;
+        size_t evictions;
+        size_t entries;
+        size_t blocks;       // KV blocks covered by the entries
+    };
+
+    DistributionCache(size_t capacity, size_t top_n, size_t max_blocks);
+
+    // Looks up the longest cached prompt that tokens[0, n) starts with. On a match cache
+    // (empty on entry) becomes a fork of the stored K/V and the matched length is returned,
+    // for an exact repeat ids / logits also receive the stored top_n logits.
+    // Returns 0 on a miss.
+    size_t lookup(const int* tokens, size_t n, KVCache& cache, std::vector<int>& ids, std::vector<float>& logits);
+
+    // Stores the prompt tokens[0, n) with the K/V of its n positions and the logits
+    // of the given ids, typically the top_n of the last position
+    void insert(const int* tokens, size_t n, const KVCache& cache, const std::vector<int>& ids, const float* logits);
+
+    // Drops the least recently used entry, returns false when the cache is empty.
+    // Meant as the reclaim hook of the KV block pool the entries draw from.
+    bool evict_oldest();
+
+    size_t top_n() const { return keep; }
+    void clear();
+    Stats stats() const;
+
+private:
+    struct Entry {
+        uint64_t hash;
+        std::vector<int> tokens;
+        std::vector<int> ids;
+        std::vector<float> logits;
+        KVCache cache;
+        size_t blocks;
+    };
+
+    size_t capacity;
+    size_t keep;
+    size_t max_blocks;
+    size_t held_blocks{0};
+    std::list<Entry> entries;  // Most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    size_t hits{0};
+    size_t prefix_hits{0};
+    size_t misses{0};
+    size_t evictions{0};
+    mutable std::mutex mutex;
+
+    // Drops the last entry of the list, the caller holds the lock
+    void pop_oldest();
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include "kv_cache.hpp"
+#include "tensor_memory.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Keys/values of prompt prefixes shared between requests, stored in a radix tree keyed on token ids.
+//
+// Every edge of the tree holds a run of tokens together with the K/V rows those tokens
+// produced in every layer. Since the K/V of a position depend on all the tokens before it,
+// a node is only valid below its own path, which is exactly what the tree encodes.
+// A new request copies the rows of its longest cached prefix into its KV cache and only
+// prefills the unseen suffix. Least recently used leaves are evicted once the stored rows
+// exceed the memory budget.
+class PrefixCache {
+public:
+    struct Stats {
+        size_t lookups;
+        size_t reused_tokens;  // Prompt tokens that did not need a prefill
+        size_t memory_bytes;
+        size_t nodes;
+    };
+
+    PrefixCache(size_t num_layers, size_t d_model, size_t memory_budget_bytes);
+
+    // Copies the K/V of the longest cached prefix of tokens[0, n) into the empty cache
+    // and returns its length. Callers pass n - 1 for a prompt, the last token always has
+    // to be run to get its logits.
+    size_t restore(const int* tokens, size_t n, KVCache& cache);
+
+    // Stores the K/V rows of the first n positions of cache, produced by tokens[0, n)
+    void insert(const int* tokens, size_t n, const KVCache& cache);
+
+    void clear();
+    Stats stats() const;
+
+    // K or V rows of a node, counted as KV memory
+    using Rows = tensor_memory::Vector<float, tensor_memory::Category::KVCache>;
+
+private:
+    struct Node {
+        std::vector<int> tokens;    // Edge label
+        Rows keys;    // [layers, tokens.size(), d_model]
+        Rows values;  // [layers, tokens.size(), d_model]
+        std::map<int, std::unique_ptr<Node>> children;  // Keyed on the first token of the child edge
+        Node* parent{nullptr};
+        uint64_t last_used{0};
+
+        size_t bytes() const { return (keys.size() + values.size()) * sizeof(float); }
+    };
+
+    Node root;
+    size_t layers;
+    size_t d_model;
+    size_t memory_budget;
+    size_t memory_used{0};
+    size_t node_count{0};
+    size_t lookups{0};
+    size_t reused_tokens{0};
+    uint64_t clock{0};
+    mutable std::mutex mutex;
+
+    // Splits node after its first length tokens and returns the new upper node
+    Node* split(Node* node, size_t length);
+    void evict();
+    Node* least_recently_used_leaf(Node* node);
+    void check_shape(const KVCache& cache) const;
+};
@@ -0,0 +1,62 @@
+// spsc_queue.hpp
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+//
+// A ring of capacity + 1 slots with a head and a tail index, one slot always stays empty
+// to tell a full ring from an empty one. The producer only writes tail, the consumer only
+// writes head, each publishes its side with a release store that the other side reads with
+// acquire, so no locks or read-modify-write operations are needed. The indices sit on
+// separate cache lines so the two threads do not invalidate each other's line on every
+// push and pop.
+template <class T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity + 1) {
+        if (capacity == 0) {
+            throw std::invalid_argument("SpscQueue needs room for at least one element");
+        }
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side, false when the queue is full (value is left untouched)
+    bool try_push(T& value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = advance(t);
+        if (next == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        slots[t] = std::move(value);
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, false when the queue is empty
+    bool try_pop(T& value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(slots[h]);
+        head.store(advance(h), std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return slots.size() - 1; }
+
+private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head{0};  // Next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail{0};  // Next slot to fill, written by the producer
+
+    size_t advance(size_t index) const {
+        return index + 1 == slots.size() ? 0 : index + 1;
+    }
+};
@@ -0,0 +1,112 @@
+// tensor_memory.hpp
+#pragma once
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+// Allocator for the engine's large buffers: packed weights, activations and KV storage.
+//
+// Every block is 64 byte aligned (one cache line, one AVX-512 register) and counted per
+// category, so the memory of a run can be broken down and its peak read back.
+// Blocks of at least huge_page_threshold bytes can be backed by 2 MB pages, which cuts
+// the TLB misses of a sweep over hundreds of MB of weights:
+//  - Transparent: 2 MB aligned and madvise(MADV_HUGEPAGE), the kernel promotes the pages
+//  - Explicit: mmap(MAP_HUGETLB) from the reserved hugetlbfs pool, falls back to
+//    Transparent when the pool is empty
+// Huge pages are Linux only, elsewhere the modes fall back to plain aligned blocks.
+namespace tensor_memory {
+
+constexpr size_t alignment = 64;
+
+enum class Category {
+    Weights,
+    Activations,
+    KVCache,
+    Other
+};
+constexpr size_t num_categories = 4;
+
+enum class HugePages {
+    Off,
+    Transparent,
+    Explicit
+};
+
+struct Counters {
+    size_t current_bytes;
+    size_t peak_bytes;
+    size_t allocations;     // Blocks handed out since start
+    size_t reserved_bytes;  // Held by reserve(), only the part reported in use is in current / peak
+};
+
+// Applies to the allocations made after the call
+void set_huge_pages(HugePages mode, size_t huge_page_threshold = size_t(2) << 20);
+HugePages huge_pages();
+
+// 64 byte aligned, uninitialized. Throws std::bad_alloc.
+void* allocate(size_t bytes, Category category);
+void deallocate(void* ptr) noexcept;
+
+// For storage reserved up front and handed out piece by piece, such as the KV block pool.
+// The block counts as reserved, its owner reports the bytes it hands out with use_reserved
+// and takes them back with release_reserved, only those count as current and peak.
+void* reserve(size_t bytes, Category category);
+void use_reserved(size_t bytes, Category category);
+void release_reserved(size_t bytes, Category category);
+
+Counters counters(Category category);
+// Sets every peak back to the current usage, e.g. to measure a single step
+void reset_peaks();
+const char* category_name(Category category);
+// One line per category with current, peak and reserved MB and the allocation count
+void print_report(std::ostream& out);
+
+// Standard allocator over allocate/deallocate, for containers of one category
+template <class T, Category C>
+class Allocator {
+public:
+    using value_type = T;
+
+    template <class U>
+    struct rebind {
+        using other = Allocator<U, C>;
+    };
+
+    Allocator() noexcept = default;
+    template <class U>
+    Allocator(const Allocator<U, C>&) noexcept {
+    }
+
+    T* allocate(size_t n) { return static_cast<T*>(tensor_memory::allocate(n * sizeof(T), C)); }
+    void deallocate(T* ptr, size_t) noexcept { tensor_memory::deallocate(ptr); }
+
+    template <class U>
+    bool operator==(const Allocator<U, C>&) const noexcept { return true; }
+    template <class U>
+    bool operator!=(const Allocator<U, C>&) const noexcept { return false; }
+};
+
+template <class T, Category C>
+using Vector = std::vector<T, Allocator<T, C>>;
+
+struct Deleter {
+    void operator()(void* ptr) const noexcept { deallocate(ptr); }
+};
+
+// Fixed size array whose elements are left uninitialized, for storage the OS should only
+// commit once it is written to
+template <class T>
+using Buffer = std::unique_ptr<T[], Deleter>;
+
+template <class T>
+Buffer<T> make_buffer(size_t count, Category category) {
+    return Buffer<T>(static_cast<T*>(allocate(count * sizeof(T), category)));
+}
+
+template <class T>
+Buffer<T> make_reserved_buffer(size_t count, Category category) {
+    return Buffer<T>(static_cast<T*>(reserve(count * sizeof(T), category)));
+}
+
+} // namespace tensor_memory
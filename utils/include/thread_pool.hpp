@@ -0,0 +1,58 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// A small fixed size pool of worker threads shared by the compute kernels.
+// parallel_for is the main entry point, the calling thread always takes part in the work
+// so nested calls (or calls while the workers are busy with other tasks) cannot deadlock.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t num_threads = std::thread::hardware_concurrency());
+
+    // One thread per listed CPU: worker i is pinned to cpus[i + 1], cpus[0] is left for the
+    // thread that calls parallel_for, which can pin itself with pin_current_thread.
+    // Pinning only has an effect on Linux.
+    explicit ThreadPool(const std::vector<unsigned>& cpus);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of threads that can work on a parallel_for, including the caller
+    size_t size() const { return workers.size() + 1; }
+
+    // Splits [0, n) into contiguous ranges and calls fn(begin, end) for each of them.
+    // Blocks until every range has been processed.
+    void parallel_for(size_t n, const std::function<void(size_t, size_t)>& fn);
+
+    // Keeps the calling thread on one CPU, returns false when that is not supported or fails
+    static bool pin_current_thread(unsigned cpu);
+
+    // Runs a single task on one of the workers and returns a future for its result
+    template <class F>
+    auto submit(F&& f) -> std::future<std::invoke_result_t<F>> {
+        using Result = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(f));
+        std::future<Result> result = task->get_future();
+        enqueue([task]() { (*task)(); });
+        return result;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    bool stopping{false};
+
+    void enqueue(std::function<void()> task);
+    void worker_loop();
+};
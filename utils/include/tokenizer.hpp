@@ -11,6 +11,9 @@
 
 class GPT2Tokenizer {
 public:
+    // Id of <|endoftext|>, the end of a generated text
+    static constexpr int end_of_text = 50256;
+
     GPT2Tokenizer(const std::string& vocab_path);
     
     // Main tokenization methods
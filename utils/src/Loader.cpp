@@ -1,61 +1,284 @@
 #include "Loader.hpp"
-#include <xtensor/xnpy.hpp>
-#include <filesystem>
+#include "thread_pool.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
 
-GPT2WeightLoader::GPT2WeightLoader() {
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// What the loader needs from a .npy header
+struct NpyHeader {
+    std::string descr;
+    bool fortran_order{false};
+    std::vector<size_t> shape;
+};
+
+struct FileCloser {
+    void operator()(std::FILE* file) const { std::fclose(file); }
+};
+using File = std::unique_ptr<std::FILE, FileCloser>;
+
+std::string weightFile(const std::string& weight_dir, const std::string& name) {
+    return weight_dir + "/" + name + ".npy";
+}
+
+std::string formatShape(const std::vector<size_t>& shape) {
+    std::ostringstream out;
+    out << "(";
+    for (size_t i = 0; i < shape.size(); ++i) {
+        out << (i ? ", " : "") << shape[i];
+    }
+    out << ")";
+    return out.str();
+}
+
+// Value of key in the header dict, up to the next top level ',' or '}'
+std::string headerField(const std::string& header, const std::string& key, const std::string& path) {
+    size_t pos = header.find("'" + key + "'");
+    if (pos == std::string::npos) {
+        throw std::runtime_error(path + ": .npy header has no '" + key + "' field");
+    }
+    pos = header.find(':', pos);
+    size_t end = pos + 1;
+    int depth = 0;
+    for (; end < header.size(); ++end) {
+        char c = header[end];
+        if (c == '(') depth++;
+        if (c == ')') depth--;
+        if (depth == 0 && (c == ',' || c == '}')) break;
+    }
+    std::string value = header.substr(pos + 1, end - pos - 1);
+    size_t first = value.find_first_not_of(" '\"");
+    size_t last = value.find_last_not_of(" '\"");
+    return first == std::string::npos ? "" : value.substr(first, last - first + 1);
+}
+
+// Format version 1.0 has a 2 byte header length, 2.0 and 3.0 a 4 byte one
+NpyHeader readNpyHeader(std::FILE* file, const std::string& path) {
+    unsigned char preamble[8];
+    if (std::fread(preamble, 1, sizeof(preamble), file) != sizeof(preamble) ||
+        std::memcmp(preamble, "\x93NUMPY", 6) != 0) {
+        throw std::runtime_error(path + ": not a .npy file");
+    }
+
+    size_t header_len = 0;
+    if (preamble[6] == 1) {
+        unsigned char len[2];
+        if (std::fread(len, 1, 2, file) != 2) {
+            throw std::runtime_error(path + ": truncated .npy header");
+        }
+        header_len = len[0] | (len[1] << 8);
+    } else {
+        unsigned char len[4];
+        if (std::fread(len, 1, 4, file) != 4) {
+            throw std::runtime_error(path + ": truncated .npy header");
+        }
+        header_len = len[0] | (len[1] << 8) | (len[2] << 16) | (static_cast<size_t>(len[3]) << 24);
+    }
+
+    std::string header(header_len, '\0');
+    if (std::fread(&header[0], 1, header_len, file) != header_len) {
+        throw std::runtime_error(path + ": truncated .npy header");
+    }
+
+    NpyHeader parsed;
+    parsed.descr = headerField(header, "descr", path);
+    parsed.fortran_order = headerField(header, "fortran_order", path) == "True";
+    std::string shape = headerField(header, "shape", path);
+    for (size_t i = 0; i < shape.size();) {
+        if (shape[i] >= '0' && shape[i] <= '9') {
+            size_t end = i;
+            while (end < shape.size() && shape[end] >= '0' && shape[end] <= '9') end++;
+            parsed.shape.push_back(std::stoull(shape.substr(i, end - i)));
+            i = end;
+        } else {
+            i++;
+        }
+    }
+    return parsed;
+}
+
+File openWeight(const std::string& path) {
+    File file(std::fopen(path.c_str(), "rb"));
+    if (!file) {
+        throw std::runtime_error(path + ": missing or unreadable");
+    }
+    return file;
+}
+
+// Little endian fp32 in C order, the layout of the exported checkpoints
+xt::xarray<float> loadNpy(const std::string& path) {
+    File file = openWeight(path);
+    NpyHeader header = readNpyHeader(file.get(), path);
+    if (header.descr != "<f4" || header.fortran_order) {
+        throw std::runtime_error(path + ": expected little endian float32 in C order, found '" + header.descr + "'" +
+                                 (header.fortran_order ? " in Fortran order" : ""));
+    }
+
+    xt::xarray<float> tensor = xt::xarray<float>::from_shape(header.shape);
+    size_t count = tensor.size();
+    if (std::fread(tensor.data(), sizeof(float), count, file.get()) != count) {
+        throw std::runtime_error(path + ": truncated data, expected " + std::to_string(count) + " floats");
+    }
+    return tensor;
+}
+
+} // namespace
+
+GPT2WeightLoader::GPT2WeightLoader(size_t num_layers) : num_layers(num_layers) {
     initializeWeightPaths();
 }
 
 void GPT2WeightLoader::initializeWeightPaths() {
-    // Embeddings
-    weight_paths.push_back("transformer.wte.weight");
-    weight_paths.push_back("transformer.wpe.weight");
-    
-    // Transformer blocks
-    for (int layer = 0; layer < 12; layer++) {
-        std::string prefix = "transformer.h." + std::to_string(layer);
-        
+    for (const auto& path : getEmbeddingWeightPaths()) {
+        weight_paths.push_back(path);
+    }
+    for (size_t layer = 0; layer < num_layers; layer++) {
+        for (const auto& path : getLayerWeightPaths(layer)) {
+            weight_paths.push_back(path);
+        }
+    }
+    for (const auto& path : getHeadWeightPaths()) {
+        weight_paths.push_back(path);
+    }
+}
+
+std::vector<std::string> GPT2WeightLoader::getEmbeddingWeightPaths() const {
+    return {"transformer.wte.weight", "transformer.wpe.weight"};
+}
+
+std::vector<std::string> GPT2WeightLoader::getLayerWeightPaths(size_t layer) const {
+    std::string prefix = "transformer.h." + std::to_string(layer);
+    return {
         // Layer norms
-        weight_paths.push_back(prefix + ".ln_1.weight");
-        weight_paths.push_back(prefix + ".ln_1.bias");
-        weight_paths.push_back(prefix + ".ln_2.weight");
-        weight_paths.push_back(prefix + ".ln_2.bias");
-        
+        prefix + ".ln_1.weight",
+        prefix + ".ln_1.bias",
+        prefix + ".ln_2.weight",
+        prefix + ".ln_2.bias",
+
         // Attention
-        weight_paths.push_back(prefix + ".attn.c_attn.weight");
-        weight_paths.push_back(prefix + ".attn.c_attn.bias");
-        weight_paths.push_back(prefix + ".attn.c_proj.weight");
-        weight_paths.push_back(prefix + ".attn.c_proj.bias");
-        
+        prefix + ".attn.c_attn.weight",
+        prefix + ".attn.c_attn.bias",
+        prefix + ".attn.c_proj.weight",
+        prefix + ".attn.c_proj.bias",
+
         // MLP
-        weight_paths.push_back(prefix + ".mlp.c_fc.weight");
-        weight_paths.push_back(prefix + ".mlp.c_fc.bias");
-        weight_paths.push_back(prefix + ".mlp.c_proj.weight");
-        weight_paths.push_back(prefix + ".mlp.c_proj.bias");
-    }
-    
+        prefix + ".mlp.c_fc.weight",
+        prefix + ".mlp.c_fc.bias",
+        prefix + ".mlp.c_proj.weight",
+        prefix + ".mlp.c_proj.bias",
+    };
+}
+
+std::vector<std::string> GPT2WeightLoader::getHeadWeightPaths() const {
     // Final layer norm and output
-    weight_paths.push_back("transformer.ln_f.weight");
-    weight_paths.push_back("transformer.ln_f.bias");
-    weight_paths.push_back("lm_head.weight");
+    return {"transformer.ln_f.weight", "transformer.ln_f.bias", "lm_head.weight"};
 }
 
 GPT2WeightLoader::WeightMap GPT2WeightLoader::loadWeights(const std::string& weight_dir) {
+    prefetch(weight_dir);
+    ThreadPool pool;
+    return loadWeights(weight_dir, weight_paths, &pool);
+}
+
+GPT2WeightLoader::WeightMap GPT2WeightLoader::loadWeights(
+    const std::string& weight_dir,
+    const std::vector<std::string>& names,
+    ThreadPool* pool
+) const {
+    std::vector<xt::xarray<float>> tensors(names.size());
+    auto load = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            std::string full_path = weightFile(weight_dir, names[i]);
+            try {
+                tensors[i] = loadNpy(full_path);
+            } catch (const std::exception& e) {
+                std::cerr << "Error loading weight file " << full_path << ": " << e.what() << std::endl;
+                throw;
+            }
+        }
+    };
+    if (pool) {
+        pool->parallel_for(names.size(), load);
+    } else {
+        load(0, names.size());
+    }
+
     WeightMap weights;
-    
-    for (const auto& path : weight_paths) {
-        std::string full_path = weight_dir + "/" + path + ".npy";
+    for (size_t i = 0; i < names.size(); ++i) {
+        weights[names[i]] = std::move(tensors[i]);
+    }
+    return weights;
+}
+
+void GPT2WeightLoader::validateShapes(const std::string& weight_dir, const ExpectedShapes& expected) const {
+    size_t d = expected.d_model;
+    auto expectedShape = [&](const std::string& name) -> std::vector<size_t> {
+        auto ends_with = [&name](const char* suffix) {
+            size_t n = std::strlen(suffix);
+            return name.size() >= n && name.compare(name.size() - n, n, suffix) == 0;
+        };
+        if (name == "transformer.wte.weight" || name == "lm_head.weight") return {expected.vocab_size, d};
+        if (name == "transformer.wpe.weight") return {expected.max_positions, d};
+        if (ends_with("attn.c_attn.weight")) return {d, 3 * d};
+        if (ends_with("attn.c_attn.bias")) return {3 * d};
+        if (ends_with("attn.c_proj.weight")) return {d, d};
+        if (ends_with("mlp.c_fc.weight")) return {d, expected.d_ff};
+        if (ends_with("mlp.c_fc.bias")) return {expected.d_ff};
+        if (ends_with("mlp.c_proj.weight")) return {expected.d_ff, d};
+        return {d};  // Layer norms and the remaining biases
+    };
+
+    std::vector<std::string> problems;
+    for (const auto& name : weight_paths) {
+        std::string path = weightFile(weight_dir, name);
         try {
-            weights[path] = xt::load_npy<float>(full_path);
+            File file = openWeight(path);
+            NpyHeader header = readNpyHeader(file.get(), path);
+            std::vector<size_t> shape = expectedShape(name);
+            if (header.shape != shape) {
+                problems.push_back(name + ": expected shape " + formatShape(shape) + ", found " + formatShape(header.shape));
+            } else if (header.descr != "<f4" || header.fortran_order) {
+                problems.push_back(name + ": expected float32 in C order, found '" + header.descr + "'");
+            }
         } catch (const std::exception& e) {
-            std::cerr << "Error loading weight file " << full_path << ": " << e.what() << std::endl;
-            throw;
+            problems.push_back(e.what());
         }
     }
-    
-    return weights;
+
+    if (!problems.empty()) {
+        std::string message = "Checkpoint " + weight_dir + " does not match the model config:";
+        for (const auto& problem : problems) {
+            message += "\n  " + problem;
+        }
+        throw std::runtime_error(message);
+    }
+}
+
+void GPT2WeightLoader::prefetch(const std::string& weight_dir) const {
+#if defined(POSIX_FADV_WILLNEED)
+    for (const auto& name : weight_paths) {
+        int fd = open(weightFile(weight_dir, name).c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;  // Reported by the load itself
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+#else
+    (void)weight_dir;
+#endif
 }
 
 const std::vector<std::string>& GPT2WeightLoader::getWeightPaths() const {
     return weight_paths;
-}
\ No newline at end of file
+}
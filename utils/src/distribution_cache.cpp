@@ -0,0 +1,132 @@
+#include "distribution_cache.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+// FNV-1a over the bytes of the token ids, extended one token at a time so that the
+// hashes of every prefix come out of a single pass
+constexpr uint64_t fnv_offset = 14695981039346656037ull;
+constexpr uint64_t fnv_prime = 1099511628211ull;
+
+uint64_t extend_hash(uint64_t hash, int token) {
+    uint32_t value = static_cast<uint32_t>(token);
+    for (int byte = 0; byte < 4; ++byte) {
+        hash ^= (value >> (8 * byte)) & 0xff;
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
+} // namespace
+
+DistributionCache::DistributionCache(size_t capacity, size_t top_n, size_t max_blocks)
+    : capacity(capacity), keep(top_n), max_blocks(max_blocks) {
+    if (capacity == 0 || top_n == 0 || max_blocks == 0) {
+        throw std::invalid_argument("DistributionCache needs room for at least one entry, one logit and one KV block");
+    }
+}
+
+size_t DistributionCache::lookup(const int* tokens, size_t n, KVCache& cache,
+                                 std::vector<int>& ids, std::vector<float>& logits) {
+    if (cache.size() != 0) {
+        throw std::invalid_argument("DistributionCache::lookup needs an empty KV cache");
+    }
+
+    std::vector<uint64_t> hashes(n);
+    uint64_t hash = fnv_offset;
+    for (size_t i = 0; i < n; ++i) {
+        hash = extend_hash(hash, tokens[i]);
+        hashes[i] = hash;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t length = n; length > 0; --length) {
+        auto it = index.find(hashes[length - 1]);
+        if (it == index.end()) {
+            continue;
+        }
+        const Entry& entry = *it->second;
+        if (entry.tokens.size() != length || !std::equal(entry.tokens.begin(), entry.tokens.end(), tokens)) {
+            continue;  // Hash collision
+        }
+
+        entries.splice(entries.begin(), entries, it->second);
+        cache = entry.cache.fork();
+        if (length == n) {
+            ids = entry.ids;
+            logits = entry.logits;
+            hits++;
+        } else {
+            prefix_hits++;
+        }
+        return length;
+    }
+    misses++;
+    return 0;
+}
+
+void DistributionCache::insert(const int* tokens, size_t n, const KVCache& cache,
+                               const std::vector<int>& ids, const float* logits) {
+    if (n == 0 || cache.size() < n) {
+        throw std::invalid_argument("DistributionCache::insert needs the K/V of every prompt token");
+    }
+
+    uint64_t hash = fnv_offset;
+    for (size_t i = 0; i < n; ++i) {
+        hash = extend_hash(hash, tokens[i]);
+    }
+
+    // The stored fork covers exactly the prompt
+    KVCache fork = cache.fork();
+    fork.resize(n);
+    std::vector<float> values;
+    values.reserve(ids.size());
+    for (int id : ids) {
+        values.push_back(logits[id]);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(hash);
+    if (it != index.end()) {
+        held_blocks -= it->second->blocks;
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    size_t blocks = fork.block_table().size();
+    entries.push_front(Entry{hash, std::vector<int>(tokens, tokens + n), ids, std::move(values), std::move(fork), blocks});
+    index[hash] = entries.begin();
+    held_blocks += blocks;
+
+    while (!entries.empty() && (entries.size() > capacity || held_blocks > max_blocks)) {
+        pop_oldest();
+    }
+}
+
+bool DistributionCache::evict_oldest() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.empty()) {
+        return false;
+    }
+    pop_oldest();
+    return true;
+}
+
+void DistributionCache::pop_oldest() {
+    held_blocks -= entries.back().blocks;
+    index.erase(entries.back().hash);
+    entries.pop_back();  // Hands the KV blocks the entry alone still held back to the pool
+    evictions++;
+}
+
+void DistributionCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    held_blocks = 0;
+}
+
+DistributionCache::Stats DistributionCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return Stats{hits, prefix_hits, misses, evictions, entries.size(), held_blocks};
+}
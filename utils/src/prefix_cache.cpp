@@ -0,0 +1,205 @@
+#include "prefix_cache.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+// Copies rows [from, from + count) of every layer out of a [layers, len, d_model] block
+PrefixCache::Rows slice_rows(const PrefixCache::Rows& src, size_t layers, size_t len, size_t d_model,
+                             size_t from, size_t count) {
+    PrefixCache::Rows out(layers * count * d_model);
+    for (size_t layer = 0; layer < layers; ++layer) {
+        auto begin = src.begin() + (layer * len + from) * d_model;
+        std::copy(begin, begin + count * d_model, out.begin() + layer * count * d_model);
+    }
+    return out;
+}
+
+} // namespace
+
+PrefixCache::PrefixCache(size_t num_layers, size_t d_model, size_t memory_budget_bytes)
+    : layers(num_layers), d_model(d_model), memory_budget(memory_budget_bytes) {
+}
+
+void PrefixCache::check_shape(const KVCache& cache) const {
+    if (cache.num_layers() != layers || cache.width() != d_model) {
+        throw std::invalid_argument("KV cache shape does not match the prefix cache");
+    }
+}
+
+size_t PrefixCache::restore(const int* tokens, size_t n, KVCache& cache) {
+    check_shape(cache);
+    if (cache.size() != 0) {
+        throw std::invalid_argument("PrefixCache::restore needs an empty KV cache");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    lookups++;
+    uint64_t now = ++clock;
+
+    // Walk down the tree, remembering how many rows of every node on the path match
+    std::vector<std::pair<const Node*, size_t>> path;
+    const Node* node = &root;
+    size_t matched = 0;
+
+    while (matched < n) {
+        auto it = node->children.find(tokens[matched]);
+        if (it == node->children.end()) {
+            break;
+        }
+
+        Node* child = it->second.get();
+        size_t m = 0;
+        while (m < child->tokens.size() && matched + m < n && child->tokens[m] == tokens[matched + m]) {
+            m++;
+        }
+
+        child->last_used = now;
+        path.emplace_back(child, m);
+        matched += m;
+
+        if (m < child->tokens.size()) {
+            break;
+        }
+        node = child;
+    }
+
+    cache.resize(matched);
+
+    size_t pos = 0;
+    for (const auto& [child, rows] : path) {
+        size_t len = child->tokens.size();
+        for (size_t layer = 0; layer < layers; ++layer) {
+            for (size_t r = 0; r < rows; ++r) {
+                size_t offset = (layer * len + r) * d_model;
+                std::copy_n(child->keys.data() + offset, d_model, cache.key(layer, pos + r));
+                std::copy_n(child->values.data() + offset, d_model, cache.value(layer, pos + r));
+            }
+        }
+        pos += rows;
+    }
+
+    reused_tokens += matched;
+    return matched;
+}
+
+void PrefixCache::insert(const int* tokens, size_t n, const KVCache& cache) {
+    check_shape(cache);
+    if (n > cache.size()) {
+        throw std::invalid_argument("PrefixCache::insert: the KV cache holds fewer positions than tokens");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t now = ++clock;
+
+    Node* node = &root;
+    size_t pos = 0;
+
+    while (pos < n) {
+        auto it = node->children.find(tokens[pos]);
+
+        if (it == node->children.end()) {
+            // Nothing cached below this point, the rest of the tokens become a new leaf
+            size_t len = n - pos;
+            auto leaf = std::make_unique<Node>();
+            leaf->tokens.assign(tokens + pos, tokens + n);
+            leaf->keys.resize(layers * len * d_model);
+            leaf->values.resize(layers * len * d_model);
+
+            for (size_t layer = 0; layer < layers; ++layer) {
+                for (size_t r = 0; r < len; ++r) {
+                    size_t offset = (layer * len + r) * d_model;
+                    std::copy_n(cache.key(layer, pos + r), d_model, leaf->keys.data() + offset);
+                    std::copy_n(cache.value(layer, pos + r), d_model, leaf->values.data() + offset);
+                }
+            }
+
+            leaf->parent = node;
+            leaf->last_used = now;
+            memory_used += leaf->bytes();
+            node_count++;
+            node->children[tokens[pos]] = std::move(leaf);
+            break;
+        }
+
+        Node* child = it->second.get();
+        size_t m = 0;
+        while (m < child->tokens.size() && pos + m < n && child->tokens[m] == tokens[pos + m]) {
+            m++;
+        }
+
+        // The edge diverges (or the tokens end) in the middle, split it at that point
+        if (m < child->tokens.size()) {
+            child = split(child, m);
+        }
+
+        child->last_used = now;
+        node = child;
+        pos += m;
+    }
+
+    evict();
+}
+
+PrefixCache::Node* PrefixCache::split(Node* node, size_t length) {
+    Node* parent = node->parent;
+    size_t len = node->tokens.size();
+    int first_token = node->tokens[0];
+
+    auto upper = std::make_unique<Node>();
+    upper->tokens.assign(node->tokens.begin(), node->tokens.begin() + length);
+    upper->keys = slice_rows(node->keys, layers, len, d_model, 0, length);
+    upper->values = slice_rows(node->values, layers, len, d_model, 0, length);
+    upper->parent = parent;
+    upper->last_used = node->last_used;
+
+    node->keys = slice_rows(node->keys, layers, len, d_model, length, len - length);
+    node->values = slice_rows(node->values, layers, len, d_model, length, len - length);
+    node->tokens.erase(node->tokens.begin(), node->tokens.begin() + length);
+    node->parent = upper.get();
+
+    // Re-hang node below the new upper node
+    std::unique_ptr<Node> owned = std::move(parent->children[first_token]);
+    upper->children[node->tokens[0]] = std::move(owned);
+
+    Node* result = upper.get();
+    parent->children[first_token] = std::move(upper);
+    node_count++;
+    return result;
+}
+
+PrefixCache::Node* PrefixCache::least_recently_used_leaf(Node* node) {
+    Node* best = nullptr;
+    for (auto& [token, child] : node->children) {
+        Node* candidate = child->children.empty() ? child.get() : least_recently_used_leaf(child.get());
+        if (candidate != nullptr && (best == nullptr || candidate->last_used < best->last_used)) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+void PrefixCache::evict() {
+    // Only leaves are evicted, an inner node is still needed by everything below it
+    while (memory_used > memory_budget) {
+        Node* leaf = least_recently_used_leaf(&root);
+        if (leaf == nullptr) {
+            break;
+        }
+        memory_used -= leaf->bytes();
+        node_count--;
+        leaf->parent->children.erase(leaf->tokens[0]);
+    }
+}
+
+void PrefixCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    root.children.clear();
+    memory_used = 0;
+    node_count = 0;
+}
+
+PrefixCache::Stats PrefixCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return Stats{lookups, reused_tokens, memory_used, node_count};
+}
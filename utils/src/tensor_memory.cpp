@@ -0,0 +1,222 @@
+#include "tensor_memory.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <ostream>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace tensor_memory {
+
+namespace {
+
+constexpr size_t huge_page_size = size_t(2) << 20;
+
+enum class Source : uint32_t {
+    Aligned,  // posix_memalign / _aligned_malloc
+    Mapped    // mmap of explicit huge pages
+};
+
+// Sits in the first cache line of every block, the caller's data starts right after it
+struct alignas(alignment) Header {
+    size_t bytes;         // Requested by the caller, what the counters see
+    size_t block_bytes;   // Whole block including the header, needed by munmap
+    Category category;
+    Source source;
+    bool reserved;        // Counted as reserved rather than current
+};
+static_assert(sizeof(Header) == alignment, "The header must keep the data 64 byte aligned");
+
+struct CategoryCounters {
+    std::atomic<size_t> current{0};
+    std::atomic<size_t> peak{0};
+    std::atomic<size_t> allocations{0};
+    std::atomic<size_t> reserved{0};
+};
+
+CategoryCounters category_counters[num_categories];
+std::atomic<HugePages> huge_page_mode{HugePages::Off};
+std::atomic<size_t> huge_page_min_bytes{huge_page_size};
+
+CategoryCounters& counters_of(Category category) {
+    return category_counters[static_cast<size_t>(category)];
+}
+
+void record_use(Category category, size_t bytes) {
+    CategoryCounters& c = counters_of(category);
+    size_t current = c.current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    size_t peak = c.peak.load(std::memory_order_relaxed);
+    while (current > peak && !c.peak.compare_exchange_weak(peak, current, std::memory_order_relaxed)) {
+    }
+}
+
+size_t round_up(size_t bytes, size_t multiple) {
+    return (bytes + multiple - 1) / multiple * multiple;
+}
+
+void* aligned_block(size_t bytes, size_t align) {
+#if defined(_WIN32)
+    return _aligned_malloc(bytes, align);
+#else
+    void* ptr = nullptr;
+    return posix_memalign(&ptr, align, bytes) == 0 ? ptr : nullptr;
+#endif
+}
+
+void free_aligned_block(void* ptr) {
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
+void* map_huge_pages(size_t bytes) {
+#if defined(MAP_HUGETLB)
+    void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+#else
+    (void)bytes;
+    return nullptr;
+#endif
+}
+
+void advise_huge_pages(void* ptr, size_t bytes) {
+#if defined(MADV_HUGEPAGE)
+    madvise(ptr, bytes, MADV_HUGEPAGE);
+#else
+    (void)ptr;
+    (void)bytes;
+#endif
+}
+
+// Allocates a block and counts it either as current or as reserved
+void* allocate_block(size_t bytes, Category category, bool reserved) {
+    size_t block_bytes = bytes + sizeof(Header);
+    HugePages mode = huge_pages();
+    bool huge = mode != HugePages::Off && block_bytes >= huge_page_min_bytes.load(std::memory_order_relaxed);
+
+    void* block = nullptr;
+    Source source = Source::Aligned;
+    if (huge) {
+        block_bytes = round_up(block_bytes, huge_page_size);
+        if (mode == HugePages::Explicit) {
+            block = map_huge_pages(block_bytes);
+            source = Source::Mapped;
+        }
+        if (!block) {
+            block = aligned_block(block_bytes, huge_page_size);
+            source = Source::Aligned;
+            if (block) {
+                advise_huge_pages(block, block_bytes);
+            }
+        }
+    } else {
+        block = aligned_block(block_bytes, alignment);
+    }
+    if (!block) {
+        throw std::bad_alloc();
+    }
+
+    new (block) Header{bytes, block_bytes, category, source, reserved};
+    if (reserved) {
+        counters_of(category).reserved.fetch_add(bytes, std::memory_order_relaxed);
+    } else {
+        record_use(category, bytes);
+    }
+    counters_of(category).allocations.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<char*>(block) + sizeof(Header);
+}
+
+} // namespace
+
+void set_huge_pages(HugePages mode, size_t huge_page_threshold) {
+    huge_page_mode.store(mode, std::memory_order_relaxed);
+    huge_page_min_bytes.store(huge_page_threshold, std::memory_order_relaxed);
+}
+
+HugePages huge_pages() {
+    return huge_page_mode.load(std::memory_order_relaxed);
+}
+
+void* allocate(size_t bytes, Category category) {
+    return allocate_block(bytes, category, false);
+}
+
+void* reserve(size_t bytes, Category category) {
+    return allocate_block(bytes, category, true);
+}
+
+void use_reserved(size_t bytes, Category category) {
+    record_use(category, bytes);
+}
+
+void release_reserved(size_t bytes, Category category) {
+    counters_of(category).current.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void deallocate(void* ptr) noexcept {
+    if (!ptr) {
+        return;
+    }
+    void* block = static_cast<char*>(ptr) - sizeof(Header);
+    const Header* header = static_cast<const Header*>(block);
+    CategoryCounters& c = counters_of(header->category);
+    (header->reserved ? c.reserved : c.current).fetch_sub(header->bytes, std::memory_order_relaxed);
+
+#if !defined(_WIN32)
+    if (header->source == Source::Mapped) {
+        munmap(block, header->block_bytes);
+        return;
+    }
+#endif
+    free_aligned_block(block);
+}
+
+Counters counters(Category category) {
+    const CategoryCounters& c = counters_of(category);
+    return Counters{
+        c.current.load(std::memory_order_relaxed),
+        c.peak.load(std::memory_order_relaxed),
+        c.allocations.load(std::memory_order_relaxed),
+        c.reserved.load(std::memory_order_relaxed)
+    };
+}
+
+void reset_peaks() {
+    for (CategoryCounters& c : category_counters) {
+        c.peak.store(c.current.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+}
+
+const char* category_name(Category category) {
+    switch (category) {
+        case Category::Weights: return "weights";
+        case Category::Activations: return "activations";
+        case Category::KVCache: return "kv_cache";
+        case Category::Other: return "other";
+    }
+    return "unknown";
+}
+
+void print_report(std::ostream& out) {
+    const double mb = 1024.0 * 1024.0;
+    out << std::left << std::setw(14) << "category" << std::right
+        << std::setw(14) << "current MB" << std::setw(14) << "peak MB" << std::setw(14) << "reserved MB"
+        << std::setw(14) << "allocations" << '\n';
+    for (size_t i = 0; i < num_categories; ++i) {
+        Category category = static_cast<Category>(i);
+        Counters c = counters(category);
+        out << std::left << std::setw(14) << category_name(category) << std::right << std::fixed << std::setprecision(1)
+            << std::setw(14) << c.current_bytes / mb << std::setw(14) << c.peak_bytes / mb
+            << std::setw(14) << c.reserved_bytes / mb << std::setw(14) << c.allocations << '\n';
+    }
+}
+
+} // namespace tensor_memory
@@ -0,0 +1,144 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+// Shared state of one parallel_for call, the helpers hold it through a shared_ptr
+// because they may only get scheduled after the caller has already finished all the work
+struct ParallelJob {
+    const std::function<void(size_t, size_t)>* fn;
+    size_t n;
+    size_t chunk;
+    size_t num_chunks;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::exception_ptr error;
+
+    // Claims chunks until none are left, returns once this thread has nothing more to do
+    void run() {
+        size_t c;
+        while ((c = next.fetch_add(1)) < num_chunks) {
+            size_t begin = c * chunk;
+            size_t end = std::min(n, begin + chunk);
+            try {
+                (*fn)(begin, end);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = std::current_exception();
+            }
+            if (done.fetch_add(1) + 1 == num_chunks) {
+                std::lock_guard<std::mutex> lock(mutex);
+                cv.notify_all();
+            }
+        }
+    }
+};
+
+} // namespace
+
+ThreadPool::ThreadPool(size_t num_threads) {
+    // The caller of parallel_for is the extra thread, so spawn one less worker
+    size_t count = std::max<size_t>(num_threads, 1) - 1;
+    workers.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        workers.emplace_back([this]() { worker_loop(); });
+    }
+}
+
+ThreadPool::ThreadPool(const std::vector<unsigned>& cpus) {
+    size_t count = cpus.empty() ? 0 : cpus.size() - 1;
+    workers.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        unsigned cpu = cpus[i + 1];
+        workers.emplace_back([this, cpu]() {
+            pin_current_thread(cpu);
+            worker_loop();
+        });
+    }
+}
+
+bool ThreadPool::pin_current_thread(unsigned cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::enqueue(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        tasks.push_back(std::move(task));
+    }
+    queue_cv.notify_one();
+}
+
+void ThreadPool::worker_loop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (stopping && tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t, size_t)>& fn) {
+    if (n == 0) {
+        return;
+    }
+    if (workers.empty() || n == 1) {
+        fn(0, n);
+        return;
+    }
+
+    // A few chunks per thread so that uneven chunks still balance out
+    auto job = std::make_shared<ParallelJob>();
+    job->fn = &fn;
+    job->n = n;
+    job->chunk = std::max<size_t>(1, (n + size() * 4 - 1) / (size() * 4));
+    job->num_chunks = (n + job->chunk - 1) / job->chunk;
+
+    size_t helpers = std::min(workers.size(), job->num_chunks - 1);
+    for (size_t i = 0; i < helpers; ++i) {
+        enqueue([job]() { job->run(); });
+    }
+
+    job->run();
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cv.wait(lock, [&job]() { return job->done.load() == job->num_chunks; });
+    if (job->error) {
+        std::rethrow_exception(job->error);
+    }
+}